@@ -0,0 +1,106 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+
+// A first-in first-out queue passing items from producer threads to consumer
+// threads. push blocks while the queue holds capacity items, and pop blocks
+// while the queue is empty.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t capacity);
+    BoundedQueue(const BoundedQueue &) = delete;
+    void cancel();
+    void close();
+    bool pop(T & item);
+    bool push(T && item);
+    BoundedQueue & operator = (const BoundedQueue &) = delete;
+private:
+    const size_t capacity;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    bool closed;
+    bool canceled;
+};
+
+template <typename T>
+BoundedQueue<T>::BoundedQueue(size_t capacity):
+    capacity(capacity),
+    closed(false),
+    canceled(false)
+{
+    if (capacity == 0)
+        throw std::invalid_argument("Capacity must be > 0");
+}
+
+// Discards the items in the queue and releases all blocked threads. From now
+// on, push and pop return false.
+template <typename T>
+void BoundedQueue<T>::cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        canceled = true;
+        items.clear();
+    }
+    notEmpty.notify_all();
+    notFull.notify_all();
+}
+
+// Signals that no more items will be pushed. pop returns false as soon as the
+// remaining items have been taken.
+template <typename T>
+void BoundedQueue<T>::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+    }
+    notEmpty.notify_all();
+}
+
+template <typename T>
+bool BoundedQueue<T>::pop(T & item)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(
+            lock,
+            [this]
+            {
+                return canceled || closed || !items.empty();
+            }
+            );
+        if (canceled || items.empty()) return false;
+        item = std::move(items.front());
+        items.pop_front();
+    }
+    notFull.notify_one();
+    return true;
+}
+
+template <typename T>
+bool BoundedQueue<T>::push(T && item)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(
+            lock,
+            [this]
+            {
+                return canceled || items.size() < capacity;
+            }
+            );
+        if (canceled) return false;
+        items.push_back(std::move(item));
+    }
+    notEmpty.notify_one();
+    return true;
+}
@@ -10,6 +10,7 @@ namespace MP3epoc
 {
     class MP3AttributeSet
     {
+        friend class MP3ResultCache;
     public:
         MP3AttributeSet();
         MP3AttributeInfoBox operator [] (MP3Attribute attribute) const;
@@ -0,0 +1,171 @@
+#include "MP3FrameIndexCache.h"
+#include "PathProcessor.h"
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+using namespace MP3epoc;
+using namespace std;
+
+namespace
+{
+    // An index file consists of this header followed by the frame sizes.
+    struct IndexFileHeader
+    {
+        char signature[8];
+        uint64_t size;
+        uint64_t modificationTime;
+        int64_t startOffset;
+        int64_t endOffset;
+        uint32_t nonFramedDataFlags;
+        uint32_t frameCount;
+    };
+
+    const char IndexFileSignature[] =
+    {
+        'M', 'P', '3', 'I', 'N', 'D', 'X', '1'
+    };
+
+    xstring
+        getIndexFilePath(
+        const xstring & dirPath,
+        const FileIdentity & identity
+        );
+
+#if defined(_WIN32)
+
+    const xchar DirSeparator = L'\\';
+
+#else // #if defined(_WIN32)
+
+    const xchar DirSeparator = '/';
+
+#endif // #if defined(_WIN32)
+
+    // The name of an index file is made up of the device and the file number
+    // of the indexed file, in hexadecimal digits.
+    xstring
+        getIndexFilePath(
+        const xstring & dirPath,
+        const FileIdentity & identity)
+    {
+        xostringstream path;
+        path <<
+            dirPath << DirSeparator << hex << setfill(XSTR('0')) <<
+            setw(16) << identity.device << XSTR('-') <<
+            setw(16) << identity.fileNumber;
+        return path.str();
+    }
+}
+
+namespace MP3epoc
+{
+    MP3FrameIndexCache::MP3FrameIndexCache(const xstring & dirPath):
+        dirPath(dirPath)
+    {
+        createDirectories(dirPath.c_str());
+    }
+
+    xstring MP3FrameIndexCache::getDefaultDirPath()
+    {
+        xstring cacheDirPath = getCacheDirPath();
+        if (cacheDirPath.empty()) return cacheDirPath;
+        return cacheDirPath.append(1, DirSeparator).append(XSTR("Frames"));
+    }
+
+    const xstring & MP3FrameIndexCache::getDirPath() const
+    {
+        return dirPath;
+    }
+
+    bool
+        MP3FrameIndexCache::load(
+        const xstring & filePath,
+        MP3FrameIndex & index)
+        const
+    {
+        FileIdentity identity;
+        if (!getFileIdentity(filePath.c_str(), identity)) return false;
+
+        ifstream stream(
+            getIndexFilePath(dirPath, identity).c_str(),
+            ios_base::binary
+            );
+        IndexFileHeader header;
+        if (
+            !stream.read(reinterpret_cast<char *>(&header), sizeof header) ||
+            memcmp(
+            header.signature,
+            IndexFileSignature,
+            sizeof IndexFileSignature
+            ) != 0 ||
+            header.size != identity.size ||
+            header.modificationTime != identity.modificationTime ||
+            header.startOffset < 0 ||
+            header.startOffset > header.endOffset ||
+            static_cast<uint64_t>(header.endOffset) > identity.size ||
+            header.frameCount > identity.size)
+            return false;
+
+        vector<uint16_t> frameSizes(header.frameCount);
+        if (
+            header.frameCount != 0 &&
+            !stream.read(
+            reinterpret_cast<char *>(frameSizes.data()),
+            header.frameCount * sizeof(uint16_t)
+            ))
+            return false;
+
+        index.startOffset = header.startOffset;
+        index.endOffset = header.endOffset;
+        index.nonFramedDataFlags =
+            static_cast<NonFramedDataFlags>(header.nonFramedDataFlags);
+        index.frameSizes.swap(frameSizes);
+        return true;
+    }
+
+    void
+        MP3FrameIndexCache::store(
+        const xstring & filePath,
+        const MP3FrameIndex & index)
+        const
+    {
+        FileIdentity identity;
+        if (!getFileIdentity(filePath.c_str(), identity)) return;
+
+        IndexFileHeader header;
+        memcpy(header.signature, IndexFileSignature, sizeof IndexFileSignature);
+        header.size = identity.size;
+        header.modificationTime = identity.modificationTime;
+        header.startOffset = index.startOffset;
+        header.endOffset = index.endOffset;
+        header.nonFramedDataFlags =
+            static_cast<uint32_t>(index.nonFramedDataFlags);
+        header.frameCount = static_cast<uint32_t>(index.frameSizes.size());
+
+        // The index is written to a temporary file first, which then replaces
+        // the index file at once, so that an incomplete index is never loaded.
+        xstring indexFilePath = getIndexFilePath(dirPath, identity);
+        xstring tempFilePath = getTempFilePath(indexFilePath);
+        bool written;
+        {
+            ofstream stream(tempFilePath.c_str(), ios_base::binary);
+            stream.write(
+                reinterpret_cast<const char *>(&header),
+                sizeof header
+                );
+            stream.write(
+                reinterpret_cast<const char *>(index.frameSizes.data()),
+                index.frameSizes.size() * sizeof(uint16_t)
+                );
+            stream.close();
+            written = !stream.fail();
+        }
+        if (
+            !written ||
+            !replaceFile(tempFilePath.c_str(), indexFilePath.c_str()))
+            removeFile(tempFilePath.c_str());
+    }
+}
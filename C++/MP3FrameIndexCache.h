@@ -0,0 +1,47 @@
+#pragma once
+
+#include "MP3GearWheel.h"
+
+#include <cstdint>
+#include <ios>
+#include <string>
+#include <vector>
+
+namespace MP3epoc
+{
+    // The layout of an MP3 file as found by an MP3GearWheel processing all of
+    // its frames.
+    struct MP3FrameIndex
+    {
+        std::streamoff startOffset;
+        std::streamoff endOffset;
+        NonFramedDataFlags nonFramedDataFlags;
+        // The size of every frame, in the order of the frames.
+        std::vector<uint16_t> frameSizes;
+    };
+
+    // Keeps the frame indices of files in a directory, one file per indexed
+    // file. An index is identified by the device and the file number of the
+    // indexed file, and it is only valid as long as the size and the time of
+    // the last modification of the file are unchanged.
+    // All methods may be invoked concurrently, also by several processes using
+    // the same directory. Errors accessing the directory are not reported: the
+    // cache simply behaves as if it were empty.
+    class MP3FrameIndexCache
+    {
+    public:
+        explicit MP3FrameIndexCache(const std::xstring & dirPath);
+        MP3FrameIndexCache(const MP3FrameIndexCache &) = delete;
+        MP3FrameIndexCache & operator = (const MP3FrameIndexCache &) = delete;
+        const std::xstring & getDirPath() const;
+        bool load(const std::xstring & filePath, MP3FrameIndex & index) const;
+        void
+            store(const std::xstring & filePath, const MP3FrameIndex & index)
+            const;
+        // Returns a directory in the cache location of the current user, or an
+        // empty string if there is no such location.
+        static std::xstring getDefaultDirPath();
+    private:
+        const std::xstring dirPath;
+    };
+}
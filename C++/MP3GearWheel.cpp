@@ -1,6 +1,26 @@
+#include "calculateCRC.h"
 #include "countLeastSignificantZeros.h"
 #include "MP3FormatException.h"
+#include "MP3FrameIndexCache.h"
 #include "MP3GearWheel.h"
+#include "MP3ResultCache.h"
+#include "MP3VBRHeader.h"
+#include "PathProcessor.h"
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <thread>
+#include <typeinfo>
+
+#if defined(__SSE2__) || defined(_M_X64) || _M_IX86_FP >= 2
+#define MP3EPOC_SSE2
+#include <emmintrin.h>
+#endif // #if defined(__SSE2__) || defined(_M_X64) || _M_IX86_FP >= 2
 
 using namespace MP3epoc;
 using namespace std;
@@ -43,62 +63,184 @@ namespace
     };
     
     const size_t BravaSoftwareIncTagSizes[] = { 8472, 8468, 8272, 8204 };
+
+    const size_t InitialWindowSize = 0x10000;
+
+    // Walking the frames before a key frame with a lower number is cheaper
+    // than locating it.
+    const FrameNumber MinLocatedKeyFrameNumber = 16;
+
+    // The size of the smallest frames: MPEG2 Layer III, 8 kbps, 24000 Hz.
+    const streamoff MinFrameSize = 24;
+
+    // Results read with a higher key frame number are not cached, because the
+    // number must fit in the read settings of a cache entry.
+    const FrameNumber MaxCachedKeyFrameNumber = 0x1fffffff;
+
+    // Patches separated by no more than MaxPatchGap bytes are merged into one
+    // block, which is read, patched and written back as a whole.
+    const streamoff MaxPatchGap = 0x4000;
+    const streamoff MaxPatchBlockSize = 0x100000;
+    const size_t MaxPendingPatches = 0x4000;
+
+    // Amount of data at the end of a file that is loaded at once to look for
+    // trailing tags. Larger tags are read piecewise.
+    const streamoff TailSize = 0x4000;
+
+    // Sampling reads this many frames after every random offset. Files whose
+    // frames fit in the sampled regions of this size are read in whole.
+    const int FramesPerSampleRegion = 4;
+    const streamoff SampleRegionSize = 0x2000;
+
+    // Amount of data searched at once for a frame header in Stream mode.
+    const size_t ScanBlockSize = 0x10000;
+
+    // Amount of data kept before the offset read last in Piped mode. It holds
+    // the largest trailing data recognized, a Brava Software Inc. tag with an
+    // ID3v1 tag, as well as the frames read ahead by MP3Stream::resync.
+    const streamoff PipedTailSize = 8472 + ID3v1TagSize;
+
+    // Amount of data read at once from the input in Piped mode. All of the
+    // input passes through the window, so splice is of no use on Linux: the
+    // headers of all frames are read and the end is searched for tags. Only
+    // the rest of the input after the key frame could be passed on unread,
+    // but MP3epoc applies attributes to whole files, and reads have no output.
+    const size_t PipedReadSize = 0x10000;
+    
+    // Frame size tables ///////////////////////////////////////////////////////
+    
+    // Frame sizes are indexed by the header bits 9 to 20 (padding, sampling
+    // rate, bitrate, protection, layer and audio version ID), protected sizes
+    // by the bits 4 to 7 (mode extension and channel mode) and 16 to 20.
+    class FrameSizeTables
+    {
+    public:
+        uint16_t frameSizes[0x1000];
+        int8_t protectedSizes[0x200];
+        FrameSizeTables();
+    };
+    
+    const FrameSizeTables frameSizeTables;
+    
+    MP3FrameHeader makeFrameHeader(uint32_t data);
+    
+    FrameSizeTables::FrameSizeTables()
+    {
+        for (uint32_t index = 0; index < 0x1000; ++index)
+        {
+            MP3FrameHeader header = makeFrameHeader(0xffe00000 | index << 9);
+            frameSizes[index] =
+                MP3FrameHeader::isValid(header) ?
+                static_cast<uint16_t>(header.calculateFrameSize()) :
+                0;
+        }
+        for (uint32_t index = 0; index < 0x200; ++index)
+        {
+            MP3FrameHeader header =
+                makeFrameHeader(
+                0xffe00000 | (index & 0x1f0) << 12 | (index & 0x00f) << 4
+                );
+            protectedSizes[index] =
+                static_cast<int8_t>(header.calculateProtectedSize());
+        }
+    }
+    
+    MP3FrameHeader makeFrameHeader(uint32_t data)
+    {
+        const uint8_t buffer[] =
+        {
+            static_cast<uint8_t>(data >> 24),
+            static_cast<uint8_t>(data >> 16),
+            static_cast<uint8_t>(data >> 8),
+            static_cast<uint8_t>(data)
+        };
+        return MP3FrameHeader(buffer);
+    }
+    
+    // Exceptions //////////////////////////////////////////////////////////////
+    
+    // Thrown when the frames of a file do not match its cached frame index.
+    class FrameIndexMismatchException: public exception
+    { };
     
     // Functions ///////////////////////////////////////////////////////////////
     
-    int calculateCRC(int size, const uint8_t buffer[]);
+    size_t findFrameHeader(const uint8_t data[], size_t size);
+    
+    bool
+        isRepeatedFrame(
+        MP3Stream & stream,
+        streamoff offset,
+        streamoff endOffset,
+        uint32_t headerData
+        );
+    
     MP3AttributeSet processFrames(
         MP3Stream & stream,
         streamoff startOffset,
+        FrameNumber startFrameNumber,
         streamoff endOffset,
         MP3AttributeSet attributeSetToApply,
         bool testCRC,
         FrameNumber keyFrameNumber,
-        bool keyFrameRequired
+        bool keyFrameRequired,
+        bool earlyExit,
+        MP3AttributeSet attributeSetToMatch,
+        const vector<uint16_t> * knownFrameSizes,
+        vector<uint16_t> * foundFrameSizes,
+        streamoff * framesEndOffset
         );
     
-    int calculateCRC(int size, const uint8_t buffer[])
-    {
-        int crc = 0xffff; // start with inverted value of 0
-        for (int index = 2;;)
-        {
-            int data = buffer[index];
-            for (int bitMask = 1 << 7; bitMask != 0; bitMask >>= 1)
-            {
-                int hiBit = crc & 0x8000;
-                crc <<= 1;
-                if (!hiBit != !(data & bitMask))
-                crc ^= 0x8005; // generator polynome
-            }
-            
-            if (index != 3)
-            {
-                ++index;
-                if (index == size) break;
-            }
-            else
-            index = 6;
-        }
-        crc &= 0xffff; // mask the result
-        return crc;
-    }
+    streamoff skipRepeatedFrames(
+        MP3Stream & stream,
+        streamoff offset,
+        uint32_t headerData,
+        FrameNumber & frameNumber,
+        const vector<uint16_t> * knownFrameSizes,
+        vector<uint16_t> * foundFrameSizes
+        );
     
+    // Processes the frames from the one at startOffset, whose number is
+    // startFrameNumber, on.
+    // Only the frames whose header changes are patched in stream, so writing
+    // the patches touches no other part of the file.
+    // If earlyExit is true, the frames are only read until the result is
+    // settled, or until it can no longer match attributeSetToMatch.
+    // If knownFrameSizes is not null, FrameIndexMismatchException is thrown as
+    // soon as a frame is found that has a different size. If foundFrameSizes
+    // is not null, the size of every frame found is appended to it.
+    // If framesEndOffset is not null, the data after the frames is not checked
+    // against endOffset: once all frames have been read, framesEndOffset is
+    // set to the offset after the last one instead.
     MP3AttributeSet processFrames(
         MP3Stream & stream,
         streamoff startOffset,
+        FrameNumber startFrameNumber,
         streamoff endOffset,
         MP3AttributeSet attributeSetToApply,
         bool testCRC,
         FrameNumber keyFrameNumber,
-        bool keyFrameRequired)
+        bool keyFrameRequired,
+        bool earlyExit,
+        MP3AttributeSet attributeSetToMatch,
+        const vector<uint16_t> * knownFrameSizes,
+        vector<uint16_t> * foundFrameSizes,
+        streamoff * framesEndOffset)
     {
         uint8_t * buffer = stream.buffer;
         const xstring & filePath = stream.getPath();
         
         MP3AttributeSet attributeSetToUpdate =
             attributeSetToApply.getUnspecified();
+        
+        // Changed frames mostly share their protected size and the changed
+        // header bits, so the last CRC delta is likely to be reused.
+        int lastProtectedSize = 0;
+        int lastHeaderDelta = 0;
+        int lastCRCDelta = 0;
+        
         streamoff offset = startOffset;
-        FrameNumber frameNumber = 1;
+        FrameNumber frameNumber = startFrameNumber;
         for (;; ++frameNumber)
         {
             if (!stream.readBuffer(offset, 4)) break;
@@ -107,10 +249,18 @@ namespace
             if (!MP3FrameHeader::isValid(header)) break;
             
             size_t size = header.getFrameSize();
+            if (
+                knownFrameSizes != nullptr &&
+                (static_cast<size_t>(frameNumber) > knownFrameSizes->size() ||
+                size != (*knownFrameSizes)[frameNumber - 1]))
+                throw FrameIndexMismatchException();
             if (size == 0)
             throw MP3FrameSizeUnknownException(filePath, offset, frameNumber);
+            if (foundFrameSizes != nullptr)
+                foundFrameSizes->push_back(static_cast<uint16_t>(size));
             
             int protectedSize = 0;
+            int crc = 0;
             
             // If a CRC exists and can be calculated, check it.
             if (testCRC)
@@ -118,25 +268,46 @@ namespace
                 protectedSize = stream.readProtectedData(header);
                 if (protectedSize > 0)
                 {
-                    int crc = calculateCRC(protectedSize, stream.buffer);
+                    crc = calculateCRC(protectedSize, stream.buffer);
                     if (crc != (buffer[4] << 8 | buffer[5]))
+                    throw
                     MP3FrameCRCTestException(filePath, offset, frameNumber);
                 }
             }
             
-            if (
+            // The original header is kept to recognize repeated frames.
+            uint32_t headerData =
+                buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+            bool hasChanged =
                 header.applyAttributes(
                 attributeSetToApply,
                 frameNumber == keyFrameNumber,
-                attributeSetToUpdate))
+                attributeSetToUpdate);
+            if (hasChanged)
             {
-                // May still have to read the protected data.
-                if (!testCRC) protectedSize = stream.readProtectedData(header);
+                // If the protected data has not been tested, the stored CRC is
+                // updated instead of being calculated, unless the protected
+                // data exceeds the frame.
+                if (!testCRC)
+                {
+                    if (header.getProtectedSize() > static_cast<int>(size))
+                    {
+                        protectedSize = stream.readProtectedData(header);
+                        if (protectedSize > 0)
+                        crc = calculateCRC(protectedSize, stream.buffer);
+                    }
+                    else
+                    {
+                        protectedSize = stream.readStoredCRC(offset, header);
+                        if (protectedSize > 0) crc = buffer[4] << 8 | buffer[5];
+                    }
+                }
                 
                 if (protectedSize == 0)
                     throw
                     MP3FrameCRCUnknownException(filePath, offset, frameNumber);
                 
+                int oldHeaderBits = buffer[2] << 8 | buffer[3];
                 header.toByteArray(buffer);
                 
                 {
@@ -145,12 +316,23 @@ namespace
                     count = 4;
                     else // have CRC
                     {
-                        int crc = calculateCRC(protectedSize, stream.buffer);
+                        int headerDelta =
+                            oldHeaderBits ^ (buffer[2] << 8 | buffer[3]);
+                        if (
+                            protectedSize != lastProtectedSize ||
+                            headerDelta != lastHeaderDelta)
+                        {
+                            lastProtectedSize = protectedSize;
+                            lastHeaderDelta = headerDelta;
+                            lastCRCDelta =
+                                calculateCRCDelta(protectedSize, headerDelta);
+                        }
+                        crc ^= lastCRCDelta;
                         buffer[4] = static_cast<uint8_t>(crc >> 8);
                         buffer[5] = static_cast<uint8_t>(crc);
                         count = 6;
                     }
-                    stream.writeBuffer(offset, count);
+                    stream.patchBuffer(offset, count);
                 }
             }
             
@@ -158,10 +340,46 @@ namespace
                 frameNumber == keyFrameNumber &&
                 !attributeSetToApply.isWholeFile())
                 return attributeSetToUpdate;
+
+            // After the key frame, the status of an attribute cannot change
+            // any more, and it can only lose its whole-file flag.
+            if (
+                earlyExit &&
+                frameNumber >= keyFrameNumber &&
+                (!attributeSetToUpdate.isWholeFile() ||
+                !attributeSetToUpdate.matches(attributeSetToMatch)))
+                return attributeSetToUpdate;
             
             offset += size;
+            
+            // After the key frame, a frame with the same header as an
+            // unchanged frame without a CRC would neither update the result
+            // nor be changed, so such frames are only counted. This is the
+            // case for most frames of a file with a constant bitrate.
+            if (
+                !hasChanged &&
+                frameNumber >= keyFrameNumber &&
+                header.getProtectedSize() < 0)
+            {
+                offset =
+                    skipRepeatedFrames(
+                    stream,
+                    offset,
+                    headerData,
+                    frameNumber,
+                    knownFrameSizes,
+                    foundFrameSizes
+                    );
+            }
         }
-        if (offset < endOffset) throw MP3DataUnknownException(filePath, offset);
+        if (
+            knownFrameSizes != nullptr &&
+            static_cast<size_t>(frameNumber - 1) != knownFrameSizes->size())
+            throw FrameIndexMismatchException();
+        if (framesEndOffset != nullptr)
+            *framesEndOffset = offset;
+        else if (offset < endOffset)
+            throw MP3DataUnknownException(filePath, offset);
         
         // If no key frame exists, only whole file attributes are meaningful to
         // be returned.
@@ -172,6 +390,143 @@ namespace
         }
         return attributeSetToUpdate;
     }
+    
+    // Skips the frames starting at offset whose header equals headerData, with
+    // the possible exception of the padding bit, and returns the offset of the
+    // first frame that does not. frameNumber is the number of the last frame
+    // before offset, and it is increased by the number of frames skipped.
+    // Frames whose size does not match knownFrameSizes are not skipped.
+    streamoff skipRepeatedFrames(
+        MP3Stream & stream,
+        streamoff offset,
+        uint32_t headerData,
+        FrameNumber & frameNumber,
+        const vector<uint16_t> * knownFrameSizes,
+        vector<uint16_t> * foundFrameSizes)
+    {
+        // The headers are compared straight in the blocks of data of stream,
+        // without being copied one by one into the buffer.
+        vector<uint8_t> storage;
+        for (;;)
+        {
+            const uint8_t * data;
+            size_t count = stream.readBlock(offset, storage, data);
+            size_t position = 0;
+            while (position + 4 <= count)
+            {
+                const uint8_t * headerBytes = data + position;
+                uint32_t nextHeaderData =
+                    headerBytes[0] << 24 | headerBytes[1] << 16 |
+                    headerBytes[2] << 8 | headerBytes[3];
+                if (((nextHeaderData ^ headerData) & ~PaddingMask) != 0)
+                    return offset + position;
+                
+                size_t size = MP3FrameHeader(headerBytes).getFrameSize();
+                if (knownFrameSizes != nullptr)
+                {
+                    if (
+                        static_cast<size_t>(frameNumber) >=
+                        knownFrameSizes->size() ||
+                        size != (*knownFrameSizes)[frameNumber])
+                        return offset + position;
+                }
+                if (foundFrameSizes != nullptr)
+                    foundFrameSizes->push_back(static_cast<uint16_t>(size));
+                ++frameNumber;
+                position += size;
+            }
+            if (count < 4) return offset;
+            offset += position;
+        }
+    }
+    
+    // Returns true if the frame at offset and the frame after it, if any
+    // before endOffset, have the header headerData, with the possible
+    // exception of the padding bit.
+    bool
+        isRepeatedFrame(
+        MP3Stream & stream,
+        streamoff offset,
+        streamoff endOffset,
+        uint32_t headerData)
+    {
+        if (offset >= endOffset) return false;
+        for (int index = 0; index < 2 && offset < endOffset; ++index)
+        {
+            if (!stream.readBuffer(offset, 4)) return false;
+            const uint8_t * buffer = stream.buffer;
+            uint32_t nextHeaderData =
+                buffer[0] << 24 | buffer[1] << 16 | buffer[2] << 8 | buffer[3];
+            if (((nextHeaderData ^ headerData) & ~PaddingMask) != 0)
+                return false;
+            offset += MP3FrameHeader(buffer).getFrameSize();
+        }
+        return true;
+    }
+    
+    // Returns the offset of the first valid frame header completely contained
+    // in data, or size if there is none.
+    size_t findFrameHeader(const uint8_t data[], size_t size)
+    {
+        size_t offset = 0;
+        
+#if defined(MP3EPOC_SSE2)
+        
+        // Test 16 offsets at once for the sync bits and a valid bitrate. The
+        // first match is a valid frame header, as long as it fits in data.
+        const __m128i ones = _mm_set1_epi8(-1);
+        const __m128i syncMask = _mm_set1_epi8(static_cast<char>(0xe0));
+        const __m128i bitrateMask = _mm_set1_epi8(static_cast<char>(0xf0));
+        for (; offset + 18 <= size; offset += 16)
+        {
+            __m128i byte0 =
+                _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + offset)
+                );
+            __m128i byte1 =
+                _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + offset + 1)
+                );
+            __m128i byte2 =
+                _mm_loadu_si128(
+                reinterpret_cast<const __m128i *>(data + offset + 2)
+                );
+            __m128i matches =
+                _mm_and_si128(
+                _mm_cmpeq_epi8(byte0, ones),
+                _mm_cmpeq_epi8(_mm_and_si128(byte1, syncMask), syncMask)
+                );
+            matches =
+                _mm_andnot_si128(
+                _mm_cmpeq_epi8(
+                _mm_and_si128(byte2, bitrateMask),
+                bitrateMask
+                ),
+                matches
+                );
+            int mask = _mm_movemask_epi8(matches);
+            if (mask != 0)
+            {
+                offset += countLeastSignificantZeros(mask);
+                return offset + 4 <= size ? offset : size;
+            }
+        }
+        
+#endif // #if defined(MP3EPOC_SSE2)
+        
+        // Look for the first byte of the sync bits only, and test the whole
+        // header where it occurs.
+        while (offset + 4 <= size)
+        {
+            const void * found = memchr(data + offset, 0xff, size - 3 - offset);
+            if (found == nullptr) break;
+            offset = static_cast<const uint8_t *>(found) - data;
+            if (MP3FrameHeader::isValid(MP3FrameHeader(data + offset)))
+                return offset;
+            ++offset;
+        }
+        return size;
+    }
 }
 
 namespace MP3epoc
@@ -226,7 +581,30 @@ namespace MP3epoc
     }
 
     // Always validate a frame header using isValid before calling this method.
-    size_t MP3FrameHeader::getFrameSize() const
+    size_t MP3FrameHeader::calculateFrameSize() const
+    {
+        int numerator, denominator;
+        if (!calculateMeanFrameSize(numerator, denominator)) return 0;
+
+        int paddingSize;
+        if (!(data & PaddingMask)) // no padding
+            paddingSize = 0;
+        else if (layer == LayerI)
+            paddingSize = 4;
+        else // Layer II, Layer III
+            paddingSize = 1;
+
+        return numerator / denominator + paddingSize;
+    }
+
+    // The frames of a stream with a constant bitrate are padded so that their
+    // mean size is the exact fraction numerator / denominator. Returns false
+    // if the size is unknown.
+    bool
+        MP3FrameHeader::calculateMeanFrameSize(
+        int & numerator,
+        int & denominator)
+        const
     {
         int id = this->id;
         int samplingRateShift;
@@ -242,14 +620,14 @@ namespace MP3epoc
                 samplingRateShift = 0;
                 break;
             default:
-                return 0;
+                return false;
         }
 
         int layer = this->layer;
-        if (layer == 0) return 0;
+        if (layer == 0) return false;
 
         int bitrate = this->bitrate;
-        if (bitrate == 0) return 0;
+        if (bitrate == 0) return false;
 
         int samplingRateBase;
         switch (this->samplingRate)
@@ -264,7 +642,7 @@ namespace MP3epoc
                 samplingRateBase = 320;
                 break;
             default:
-                return 0;
+                return false;
         }
 
         // Frame size can be calculated
@@ -282,23 +660,12 @@ namespace MP3epoc
 
         int realSamplingRateDiv25 = samplingRateBase << samplingRateShift;
 
-        int paddingSize;
-        if (!(data & PaddingMask)) // no padding
-            paddingSize = 0;
-        else if (layer == LayerI)
-            paddingSize = 4;
-        else // Layer II, Layer III
-            paddingSize = 1;
-
-        return
-            samplesPerFrameDiv8 * realBitrateDiv25
-            /
-            realSamplingRateDiv25
-            +
-            paddingSize;
+        numerator = samplesPerFrameDiv8 * realBitrateDiv25;
+        denominator = realSamplingRateDiv25;
+        return true;
     }
 
-    int MP3FrameHeader::getProtectedSize() const
+    int MP3FrameHeader::calculateProtectedSize() const
     {
         if (protection) return -1;
 
@@ -332,6 +699,20 @@ namespace MP3epoc
         return 0;
     }
 
+    // Always validate a frame header using isValid before calling this method.
+    size_t MP3FrameHeader::getFrameSize() const
+    {
+        return frameSizeTables.frameSizes[data >> 9 & 0xfff];
+    }
+
+    int MP3FrameHeader::getProtectedSize() const
+    {
+        return
+            frameSizeTables.protectedSizes[
+            (data >> 12 & 0x1f0) | (data >> 4 & 0x00f)
+            ];
+    }
+
     int MP3FrameHeader::getStatus(MP3Attribute attribute) const
     {
         uint32_t mask = AttributeMasks[static_cast<int>(attribute)];
@@ -372,7 +753,13 @@ namespace MP3epoc
     { }
 
     MP3GearWheel::MP3GearWheel(bool skipTest):
-        keyFrameNumber(1), skipTest(skipTest)
+        nonFramedDataField(NonFramedDataFlags::None),
+        earlyExit(false),
+        keyFrameApproximate(false),
+        keyFrameNumber(1),
+        readMode(MP3ReadMode::MemoryMapped),
+        readWindowSize(MP3Stream::DefaultWindowSize),
+        skipTest(skipTest)
     { }
     
     MP3GearWheel::MP3GearWheel(
@@ -388,20 +775,141 @@ namespace MP3epoc
         return applyAttributes(filePath, attributeSetToApply, false);
     }
 
+    MP3AttributeSet MP3GearWheel::applyAttributes(uint8_t data[], size_t size)
+    {
+        return applyAttributes(data, size, attributeSetToApply, false);
+    }
+
     MP3AttributeSet
         MP3GearWheel::applyAttributes(
-        const xstring & filePath,
+        istream & input,
+        ostream & output,
+        const xstring & name)
+    {
+        return
+            applyAttributes(input, &output, name, attributeSetToApply, false);
+    }
+
+    vector<MP3FileResult>
+        MP3GearWheel::applyAttributes(
+        const vector<xstring> & filePaths,
+        unsigned int threadCount) const
+    {
+        return processFiles(filePaths, true, threadCount);
+    }
+
+    // Like the file version, but without the caches, which identify files by
+    // their path.
+    MP3AttributeSet
+        MP3GearWheel::applyAttributes(
+        uint8_t data[],
+        size_t size,
         MP3AttributeSet attributeSetToApply,
         bool keyFrameRequired)
     {
         try
         {
+            MP3Stream stream(data, size);
             return
+                processStream(
+                stream,
+                attributeSetToApply,
+                keyFrameRequired,
+                nullptr,
+                nullptr
+                );
+        }
+        catch (const MP3GenericException &)
+        {
+            throw;
+        }
+        catch (const exception &)
+        {
+            throw MP3GenericException(xstring());
+        }
+    }
+
+    // Like the file version, but without the caches. If output is null, the
+    // input is only read as far as needed.
+    MP3AttributeSet
+        MP3GearWheel::applyAttributes(
+        istream & input,
+        ostream * output,
+        const xstring & name,
+        MP3AttributeSet attributeSetToApply,
+        bool keyFrameRequired)
+    {
+        try
+        {
+            MP3Stream stream(name, input, output);
+            return
+                processStream(
+                stream,
+                attributeSetToApply,
+                keyFrameRequired,
+                nullptr,
+                nullptr
+                );
+        }
+        catch (const MP3GenericException &)
+        {
+            throw;
+        }
+        catch (const exception &)
+        {
+            throw MP3GenericException(name);
+        }
+    }
+
+    MP3AttributeSet
+        MP3GearWheel::applyAttributes(
+        const xstring & filePath,
+        MP3AttributeSet attributeSetToApply,
+        bool keyFrameRequired)
+    {
+        try
+        {
+            // The result of reading a file depends on the settings used.
+            FileIdentity identity;
+            // Results that are only meaningful as a non-match are not cached.
+            uint32_t readSettings =
+                static_cast<uint32_t>(keyFrameNumber) << 3 |
+                (earlyExit ? 0x04 : 0x00) |
+                (attributeSetToApply.isWholeFile() ? 0x02 : 0x00) |
+                (keyFrameRequired ? 0x01 : 0x00);
+            bool cacheable =
+                resultCache &&
+                attributeSetToApply.isUnspecified() &&
+                (!earlyExit || attributeSetToMatch.isUnspecified()) &&
+                (!keyFrameApproximate || attributeSetToApply.isWholeFile()) &&
+                keyFrameNumber <= MaxCachedKeyFrameNumber &&
+                getFileIdentity(filePath.c_str(), identity);
+            MP3AttributeSet attributeSetBefore;
+            if (
+                cacheable &&
+                resultCache->load(
+                identity,
+                readSettings,
+                attributeSetBefore,
+                nonFramedDataField))
+                return attributeSetBefore;
+
+            attributeSetBefore =
                 internalApplyAttributes(
                 filePath,
                 attributeSetToApply,
                 keyFrameRequired
                 );
+            if (cacheable)
+            {
+                resultCache->store(
+                    identity,
+                    readSettings,
+                    attributeSetBefore,
+                    nonFramedDataField
+                    );
+            }
+            return attributeSetBefore;
         }
         catch (const MP3GenericException &)
         {
@@ -413,126 +921,787 @@ namespace MP3epoc
         }
     }
 
+    unique_ptr<MP3GearWheel> MP3GearWheel::clone() const
+    {
+        assert(typeid(*this) == typeid(MP3GearWheel));
+        return unique_ptr<MP3GearWheel>(new MP3GearWheel(*this));
+    }
+
+    // Looks for the tags and the nonframed data around the frames of stream,
+    // and sets startOffset to the offset of the first frame, and endOffset to
+    // the offset of the trailing data. In Piped mode, the trailing data can
+    // only be looked for at the end of the frames, and endOffset is set to -1.
+    void
+        MP3GearWheel::findFrames(
+        MP3Stream & stream,
+        streamoff & startOffset,
+        streamoff & endOffset)
+    {
+        const xstring & filePath = stream.getPath();
+
+        // Look for ID3v2 tag //////////////////////////////////////////////////
+
+        startOffset = stream.getID3v2TagSize();
+        if (startOffset != 0)
+        {
+            // Set flag first.
+            nonFramedDataField |= NonFramedDataFlags::ID3v2Tag;
+            if (startOffset > stream.getSize())
+                throw MP3FirstFrameNotFoundException(filePath, 0);
+        }
+
+        if (stream.getReadMode() != MP3ReadMode::Piped)
+        {
+            // The following code assumes that startOffset is still set to the
+            // length of the ID3v2 tag, or 0.
+            NonFramedDataFlags flags =
+                stream.findTrailingData(startOffset, endOffset);
+            if (flags != NonFramedDataFlags::None) nonFramedDataField |= flags;
+        }
+        else
+            endOffset = -1;
+
+        // Detect nonframed data before first frame ////////////////////////////
+
+        streamoff newStart = stream.resync(startOffset);
+        if (newStart < 0) throw MP3FileInvalidException(filePath, startOffset);
+        if (newStart != startOffset)
+        {
+            nonFramedDataField |= NonFramedDataFlags::DataBeforeFirstFrame;
+            startOffset = newStart;
+        }
+    }
+
     MP3AttributeSet MP3GearWheel::getAttributeSetToApply() const
     {
         return attributeSetToApply;
     }
 
+    MP3AttributeSet MP3GearWheel::getAttributeSetToMatch() const
+    {
+        return attributeSetToMatch;
+    }
+
+    shared_ptr<MP3FrameIndexCache> MP3GearWheel::getFrameIndexCache() const
+    {
+        return frameIndexCache;
+    }
+
     FrameNumber MP3GearWheel::getKeyFrameNumber() const
     {
         return keyFrameNumber;
     }
 
+    MP3ReadMode MP3GearWheel::getReadMode() const
+    {
+        return readMode;
+    }
+
+    size_t MP3GearWheel::getReadWindowSize() const
+    {
+        return readWindowSize;
+    }
+
+    shared_ptr<MP3ResultCache> MP3GearWheel::getResultCache() const
+    {
+        return resultCache;
+    }
+
     MP3AttributeSet
         MP3GearWheel::internalApplyAttributes(
         const xstring & filePath,
         MP3AttributeSet attributeSetToApply,
         bool keyFrameRequired)
     {
-        // First of all, let's clear the nonframed data field.
-        nonFramedDataField = NonFramedDataFlags::None;
+        // Frame indices are only kept for files whose frames are all processed.
+        if (
+            !frameIndexCache ||
+            !attributeSetToApply.isWholeFile() ||
+            (earlyExit && attributeSetToApply.isUnspecified()))
+        {
+            return
+                processStream(
+                filePath,
+                attributeSetToApply,
+                keyFrameRequired,
+                nullptr,
+                nullptr
+                );
+        }
+
+        // A cached index is only used if it can be verified before the file is
+        // changed. If it turns out not to match the file, the file is processed
+        // again from the start.
+        MP3FrameIndex frameIndex;
+        if (
+            (attributeSetToApply.isUnspecified() || !skipTest) &&
+            frameIndexCache->load(filePath, frameIndex))
+        {
+            try
+            {
+                MP3AttributeSet attributeSetBefore =
+                    processStream(
+                    filePath,
+                    attributeSetToApply,
+                    keyFrameRequired,
+                    &frameIndex,
+                    nullptr
+                    );
+
+                // Changing the attributes does not move any frames, but the
+                // index must be stored again for the file as it is now.
+                if (!attributeSetBefore.matches(attributeSetToApply))
+                    frameIndexCache->store(filePath, frameIndex);
+                return attributeSetBefore;
+            }
+            catch (const FrameIndexMismatchException &)
+            { }
+        }
+
+        MP3AttributeSet attributeSetBefore =
+            processStream(
+            filePath,
+            attributeSetToApply,
+            keyFrameRequired,
+            nullptr,
+            &frameIndex
+            );
+        frameIndexCache->store(filePath, frameIndex);
+        return attributeSetBefore;
+    }
+
+    bool MP3GearWheel::isEarlyExit() const
+    {
+        return earlyExit;
+    }
+
+    bool MP3GearWheel::isKeyFrameApproximate() const
+    {
+        return keyFrameApproximate;
+    }
+
+    bool MP3GearWheel::isSkipTest() const
+    {
+        return skipTest;
+    }
+
+    // Returns the offset of the key frame of stream, or of a frame before it,
+    // which can be found without walking the frames from startOffset on, and
+    // sets frameNumber to the number of that frame. If key frames may be
+    // approximate, the frame returned may also be near the key frame, and
+    // frameNumber is then set to the key frame number.
+    streamoff
+        MP3GearWheel::locateKeyFrame(
+        MP3Stream & stream,
+        streamoff startOffset,
+        streamoff endOffset,
+        FrameNumber & frameNumber)
+    {
+        frameNumber = 1;
+        if (
+            keyFrameNumber < MinLocatedKeyFrameNumber ||
+            keyFrameNumber > (endOffset - startOffset) / MinFrameSize)
+            return startOffset;
+
+        // A cached frame index gives the exact offset.
+        MP3FrameIndex frameIndex;
+        if (
+            frameIndexCache &&
+            frameIndexCache->load(stream.getPath(), frameIndex) &&
+            frameIndex.startOffset == startOffset &&
+            frameIndex.endOffset == endOffset &&
+            static_cast<size_t>(keyFrameNumber) <= frameIndex.frameSizes.size())
+        {
+            streamoff offset = startOffset;
+            for (FrameNumber number = 1; number < keyFrameNumber; ++number)
+                offset += frameIndex.frameSizes[number - 1];
+            frameNumber = keyFrameNumber;
+            return offset;
+        }
+
+        // The audio frames follow the frame holding a VBR header.
+        MP3VBRHeader vbrHeader;
+        bool hasVBRHeader = stream.readVBRHeader(startOffset, vbrHeader);
+        streamoff audioOffset = startOffset;
+        FrameNumber audioFrameNumber = 1;
+        if (hasVBRHeader)
+        {
+            audioOffset += MP3FrameHeader(stream.buffer).getFrameSize();
+            audioFrameNumber = 2;
+        }
+        if (audioOffset >= endOffset || !stream.readBuffer(audioOffset, 4))
+            return startOffset;
+        MP3FrameHeader header = MP3FrameHeader(stream.buffer);
+        if (!MP3FrameHeader::isValid(header)) return startOffset;
+
+        // A file with an Info header has a constant bitrate. Its frames are
+        // padded so that they never start a byte or more away from where
+        // frames of the mean size would. The frame and byte counts of the
+        // header confirm that all frames have the mean size; without them, or
+        // without an Info header, the file only usually has a constant
+        // bitrate, which is assumed only if key frames may be approximate. If
+        // the frames found there share the header of the first audio frame,
+        // they are taken to be the key frame and the frame after it.
+        int numerator, denominator;
+        bool constantBitrateLikely =
+            (!hasVBRHeader || vbrHeader.type == MP3VBRHeader::Type::Info) &&
+            header.calculateMeanFrameSize(numerator, denominator);
+        bool constantBitrateConfirmed =
+            constantBitrateLikely &&
+            hasVBRHeader &&
+            vbrHeader.byteCount == endOffset - startOffset &&
+            keyFrameNumber - audioFrameNumber < vbrHeader.frameCount &&
+            abs(
+            (endOffset - audioOffset) * denominator -
+            static_cast<streamoff>(vbrHeader.frameCount) * numerator
+            ) < denominator;
+        if (
+            constantBitrateConfirmed ||
+            (keyFrameApproximate && constantBitrateLikely))
+        {
+            uint32_t headerData =
+                stream.buffer[0] << 24 | stream.buffer[1] << 16 |
+                stream.buffer[2] << 8 | stream.buffer[3];
+            streamoff estimatedOffset =
+                audioOffset +
+                (keyFrameNumber - audioFrameNumber) * numerator / denominator;
+            for (
+                streamoff offset = estimatedOffset - 1;
+                offset <= estimatedOffset + 1;
+                ++offset)
+            {
+                if (isRepeatedFrame(stream, offset, endOffset, headerData))
+                {
+                    frameNumber = keyFrameNumber;
+                    return offset;
+                }
+            }
+        }
 
+        // Otherwise, the offset of the key frame is interpolated between the
+        // seek points around it, and the next frame is taken.
+        if (
+            keyFrameApproximate &&
+            hasVBRHeader &&
+            !vbrHeader.seekPoints.empty() &&
+            keyFrameNumber - audioFrameNumber < vbrHeader.frameCount)
+        {
+            uint32_t frameCount =
+                static_cast<uint32_t>(keyFrameNumber - audioFrameNumber);
+            MP3VBRHeader::SeekPoint seekPoint = { 0, 0 };
+            MP3VBRHeader::SeekPoint nextSeekPoint =
+            {
+                vbrHeader.frameCount,
+                static_cast<uint32_t>(endOffset - startOffset)
+            };
+            for (const MP3VBRHeader::SeekPoint & point: vbrHeader.seekPoints)
+            {
+                if (point.frameCount <= frameCount)
+                    seekPoint = point;
+                else
+                {
+                    nextSeekPoint = point;
+                    break;
+                }
+            }
+            streamoff segmentSize =
+                static_cast<streamoff>(nextSeekPoint.offset) -
+                static_cast<streamoff>(seekPoint.offset);
+            streamoff estimatedOffset =
+                startOffset + seekPoint.offset +
+                segmentSize * (frameCount - seekPoint.frameCount) /
+                (nextSeekPoint.frameCount - seekPoint.frameCount);
+            streamoff offset = stream.resync(estimatedOffset);
+            if (offset >= 0 && offset < endOffset)
+            {
+                frameNumber = keyFrameNumber;
+                return offset;
+            }
+        }
+        return startOffset;
+    }
+
+    // Every thread uses its own clone of the gear wheel, which is left with
+    // the nonframed data flags of the file it has just processed.
+    vector<MP3FileResult>
+        MP3GearWheel::processFiles(
+        const vector<xstring> & filePaths,
+        bool applying,
+        unsigned int threadCount) const
+    {
+        vector<MP3FileResult> fileResults(filePaths.size());
+        if (threadCount == 0)
+            threadCount = max(thread::hardware_concurrency(), 1U);
+        if (threadCount > filePaths.size())
+            threadCount = static_cast<unsigned int>(filePaths.size());
+        if (threadCount == 0) return fileResults;
+
+        vector<unique_ptr<MP3GearWheel>> threadGearWheels;
+        threadGearWheels.reserve(threadCount);
+        for (unsigned int index = 0; index < threadCount; ++index)
+            threadGearWheels.push_back(clone());
+        auto
+            processFile =
+            [&] (unsigned int threadIndex, size_t fileIndex)
+            {
+                MP3GearWheel & gearWheel = *threadGearWheels[threadIndex];
+                MP3FileResult & fileResult = fileResults[fileIndex];
+                try
+                {
+                    const xstring & filePath = filePaths[fileIndex];
+                    fileResult.attributeSet =
+                        applying ?
+                        gearWheel.applyAttributes(filePath) :
+                        gearWheel.readAttributes(filePath);
+                    fileResult.nonFramedDataFlags =
+                        gearWheel.nonFramedDataField;
+                }
+                catch (...)
+                {
+                    fileResult.exception = current_exception();
+                }
+            };
+
+        // Every task writes to its own result only.
+        if (threadCount == 1)
+        {
+            size_t fileCount = filePaths.size();
+            for (size_t fileIndex = 0; fileIndex < fileCount; ++fileIndex)
+                processFile(0, fileIndex);
+        }
+        else
+        {
+            WorkStealingPool pool(threadCount, filePaths.size(), processFile);
+            pool.join();
+        }
+        return fileResults;
+    }
+
+    MP3AttributeSet
+        MP3GearWheel::processStream(
+        const xstring & filePath,
+        MP3AttributeSet attributeSetToApply,
+        bool keyFrameRequired,
+        const MP3FrameIndex * knownFrameIndex,
+        MP3FrameIndex * foundFrameIndex)
+    {
         ios_base::openmode access =
             attributeSetToApply.isUnspecified() ?
             ios_base::in | ios_base::binary :
             ios_base::in | ios_base::out | ios_base::binary;
-        MP3Stream stream(filePath, access);
+        MP3Stream stream(filePath, access, readMode, readWindowSize);
+        return
+            processStream(
+            stream,
+            attributeSetToApply,
+            keyFrameRequired,
+            knownFrameIndex,
+            foundFrameIndex
+            );
+    }
 
-        // Look for ID3v2 tag //////////////////////////////////////////////////
+    // Processes the frames in stream. If knownFrameIndex is not null, the
+    // file is expected to have that layout, and FrameIndexMismatchException is
+    // thrown before anything is changed if it has not. If foundFrameIndex is
+    // not null, it is set to the layout found.
+    MP3AttributeSet
+        MP3GearWheel::processStream(
+        MP3Stream & stream,
+        MP3AttributeSet attributeSetToApply,
+        bool keyFrameRequired,
+        const MP3FrameIndex * knownFrameIndex,
+        MP3FrameIndex * foundFrameIndex)
+    {
+        // First of all, let's clear the nonframed data field.
+        nonFramedDataField = NonFramedDataFlags::None;
 
         streamoff startOffset, endOffset;
+        const vector<uint16_t> * knownFrameSizes = nullptr;
+        vector<uint16_t> * foundFrameSizes = nullptr;
+        if (knownFrameIndex != nullptr)
+        {
+            startOffset = knownFrameIndex->startOffset;
+            endOffset = knownFrameIndex->endOffset;
+            nonFramedDataField = knownFrameIndex->nonFramedDataFlags;
+            knownFrameSizes = &knownFrameIndex->frameSizes;
+        }
+        else
+            findFrames(stream, startOffset, endOffset);
+        if (foundFrameIndex != nullptr)
+        {
+            foundFrameIndex->startOffset = startOffset;
+            foundFrameIndex->endOffset = endOffset;
+            foundFrameIndex->nonFramedDataFlags = nonFramedDataField;
+            foundFrameIndex->frameSizes.clear();
+            foundFrameSizes = &foundFrameIndex->frameSizes;
+
+            // The frame count of a VBR header saves growing the table, as
+            // far as it is plausible for the size of the frames.
+            MP3VBRHeader vbrHeader;
+            if (stream.readVBRHeader(startOffset, vbrHeader))
+            {
+                foundFrameSizes->reserve(
+                    static_cast<size_t>(
+                    min<streamoff>(
+                    vbrHeader.frameCount + 1,
+                    (endOffset - startOffset) / MinFrameSize
+                    )
+                    )
+                    );
+            }
+        }
 
-        startOffset = stream.getID3v2TagSize();
-        if (startOffset != 0)
+        // Process frames //////////////////////////////////////////////////////
+
+        FrameNumber keyFrameNumber = this->keyFrameNumber;
+
+        // Reads of the key frame only may start right at the key frame.
+        streamoff offset = startOffset;
+        FrameNumber frameNumber = 1;
+        bool piped = stream.getReadMode() == MP3ReadMode::Piped;
+        if (
+            attributeSetToApply.isUnspecified() &&
+            !attributeSetToApply.isWholeFile() &&
+            !piped)
         {
-            // Set flag first.
-            nonFramedDataField |= NonFramedDataFlags::ID3v2Tag;
-            if (startOffset > stream.getSize())
-                throw MP3FirstFrameNotFoundException(filePath, 0);
+            offset =
+                locateKeyFrame(stream, startOffset, endOffset, frameNumber);
+        }
+
+        // Unless the test is skipped, the frames are tested while they are
+        // changed, and the changes are only written once all frames have
+        // passed, so that a file that fails the test is left untouched.
+        bool testCRC = !skipTest || attributeSetToApply.isUnspecified();
+        stream.setPatchesDeferred(testCRC);
+
+        MP3AttributeSet attributeSetBefore;
+        try
+        {
+            streamoff framesEndOffset = -1;
+            attributeSetBefore =
+                processFrames(
+                stream,
+                offset,
+                frameNumber,
+                endOffset,
+                attributeSetToApply,
+                testCRC,
+                keyFrameNumber,
+                keyFrameRequired,
+                earlyExit && attributeSetToApply.isUnspecified(),
+                attributeSetToMatch,
+                knownFrameSizes,
+                foundFrameSizes,
+                piped ? &framesEndOffset : nullptr
+                );
+
+            // The data after the frames of a pipe is checked once it has all
+            // been read, unless not all frames have been read.
+            if (framesEndOffset >= 0)
+            {
+                NonFramedDataFlags flags =
+                    stream.findTrailingData(startOffset, endOffset);
+                if (flags != NonFramedDataFlags::None)
+                    nonFramedDataField |= flags;
+                if (framesEndOffset < endOffset)
+                    throw
+                    MP3DataUnknownException(stream.getPath(), framesEndOffset);
+            }
+        }
+        catch (const exception &)
+        {
+            // If the test is skipped, frames changed before the error occurred
+            // are still written.
+            // A failure to write them must not hide the original error.
+            if (testCRC)
+                stream.discardPatches();
+            else
+            {
+                try
+                {
+                    stream.writePatches();
+                }
+                catch (const exception &)
+                {
+                    stream.discardPatches();
+                }
+            }
+            throw;
+        }
+        stream.writePatches();
+        return attributeSetBefore;
+    }
+
+    MP3AttributeSet MP3GearWheel::readAttributes(const xstring & filePath)
+    {
+        return readAttributes(filePath, attributeSetToApply.isWholeFile());
+    }
+
+    MP3AttributeSet
+        MP3GearWheel::readAttributes(const xstring & filePath, bool wholeFile)
+    {
+        MP3AttributeSet attributeSetToApply;
+        attributeSetToApply.setWholeFile(wholeFile);
+        return applyAttributes(filePath, attributeSetToApply, true);
+    }
+
+    MP3AttributeSet
+        MP3GearWheel::readAttributes(const uint8_t data[], size_t size)
+    {
+        return readAttributes(data, size, attributeSetToApply.isWholeFile());
+    }
+
+    // The data is not changed, since no attributes are applied.
+    MP3AttributeSet
+        MP3GearWheel::readAttributes(
+        const uint8_t data[],
+        size_t size,
+        bool wholeFile)
+    {
+        MP3AttributeSet attributeSetToApply;
+        attributeSetToApply.setWholeFile(wholeFile);
+        return
+            applyAttributes(
+            const_cast<uint8_t *>(data),
+            size,
+            attributeSetToApply,
+            true
+            );
+    }
+
+    MP3AttributeSet
+        MP3GearWheel::readAttributes(istream & input, const xstring & name)
+    {
+        MP3AttributeSet attributeSetToApply;
+        attributeSetToApply.setWholeFile(
+            this->attributeSetToApply.isWholeFile()
+            );
+        return applyAttributes(input, nullptr, name, attributeSetToApply, true);
+    }
+
+    vector<MP3FileResult>
+        MP3GearWheel::readAttributes(
+        const vector<xstring> & filePaths,
+        unsigned int threadCount) const
+    {
+        return processFiles(filePaths, false, threadCount);
+    }
+
+    bool
+        MP3GearWheel::readVBRHeader(
+        const xstring & filePath,
+        MP3VBRHeader & vbrHeader)
+    {
+        try
+        {
+            nonFramedDataField = NonFramedDataFlags::None;
+            MP3Stream stream(
+                filePath,
+                ios_base::in | ios_base::binary,
+                readMode,
+                readWindowSize
+                );
+            streamoff startOffset, endOffset;
+            findFrames(stream, startOffset, endOffset);
+
+            MP3VBRHeader newHeader;
+            if (!stream.readVBRHeader(startOffset, newHeader)) return false;
+
+            // A header left over from before the file was cut or joined does
+            // not match the size of the frames. Encoders disagree on whether
+            // the header frame is included in the byte count.
+            streamoff maxByteCount = endOffset - startOffset;
+            streamoff minByteCount =
+                maxByteCount -
+                static_cast<streamoff>(
+                MP3FrameHeader(stream.buffer).getFrameSize()
+                );
+            if (
+                newHeader.byteCount != 0 &&
+                (newHeader.byteCount > maxByteCount ||
+                newHeader.byteCount < minByteCount))
+                return false;
+            vbrHeader = newHeader;
+            return true;
+        }
+        catch (const MP3GenericException &)
+        {
+            throw;
         }
-
+        catch (const exception &)
         {
-            // The following code assumes that startOffset is still set to the
-            // length of the ID3v2 tag, or 0.
-            NonFramedDataFlags flags = stream.findTrailingData(startOffset);
-            if (flags != NonFramedDataFlags::None) nonFramedDataField |= flags;
+            throw MP3GenericException(filePath);
         }
-        stream.clear();
-        endOffset = stream.tellg();
-
-        // Detect nonframed data before first frame ////////////////////////////
+    }
 
-        streamoff newStart = stream.resync(startOffset);
-        if (newStart < 0) throw MP3FileInvalidException(filePath, startOffset);
-        if (newStart != startOffset)
+    MP3AttributeSet
+        MP3GearWheel::sampleAttributes(
+        const xstring & filePath,
+        unsigned int regionCount,
+        double & sampledShare)
+    {
+        if (regionCount == 0)
+            throw invalid_argument("Region count must be > 0");
+        try
         {
-            nonFramedDataField |= NonFramedDataFlags::DataBeforeFirstFrame;
-            startOffset = newStart;
+            streamoff startOffset, endOffset;
+            {
+                nonFramedDataField = NonFramedDataFlags::None;
+                MP3Stream stream(
+                    filePath,
+                    ios_base::in | ios_base::binary,
+                    readMode,
+                    readWindowSize
+                    );
+                findFrames(stream, startOffset, endOffset);
+                if (endOffset - startOffset > regionCount * SampleRegionSize)
+                {
+                    return
+                        sampleFrames(
+                        stream,
+                        startOffset,
+                        endOffset,
+                        regionCount,
+                        sampledShare
+                        );
+                }
+            }
+            sampledShare = 1;
+            return readAttributes(filePath, true);
         }
-
-        // Process frames //////////////////////////////////////////////////////
-
-        FrameNumber keyFrameNumber = this->keyFrameNumber;
-
-        bool testCRC;
-        if (!skipTest && !attributeSetToApply.isUnspecified())
+        catch (const MP3GenericException &)
         {
-            MP3AttributeSet attributeSetBefore =
-                processFrames(
-                stream,
-                startOffset,
-                endOffset,
-                attributeSetToApply.getUnspecified(),
-                true,
-                keyFrameNumber,
-                keyFrameRequired
-                );
-
-            // If no changes are required:
-            if (attributeSetBefore.matches(attributeSetToApply))
-                return attributeSetBefore;
-
-            testCRC = false;
+            throw;
         }
-        else
-            testCRC = true;
-        return
+        catch (const exception &)
+        {
+            throw MP3GenericException(filePath);
+        }
+    }
+
+    // Reads the key frame, then resyncs at a random offset in each of
+    // regionCount regions of equal size, and reads a few frames from there.
+    MP3AttributeSet
+        MP3GearWheel::sampleFrames(
+        MP3Stream & stream,
+        streamoff startOffset,
+        streamoff endOffset,
+        unsigned int regionCount,
+        double & sampledShare)
+    {
+        FrameNumber frameNumber;
+        streamoff offset =
+            locateKeyFrame(stream, startOffset, endOffset, frameNumber);
+        MP3AttributeSet attributeSet =
             processFrames(
             stream,
-            startOffset,
+            offset,
+            frameNumber,
             endOffset,
-            attributeSetToApply,
-            testCRC,
+            MP3AttributeSet(),
+            true,
             keyFrameNumber,
-            keyFrameRequired
+            true,
+            false,
+            MP3AttributeSet(),
+            nullptr,
+            nullptr,
+            nullptr
             );
+        attributeSet.setWholeFile(true);
+
+        // The regions are always chosen the same way for a file of the same
+        // size, so that the estimate of an unchanged file does not change.
+        minstd_rand random(static_cast<minstd_rand::result_type>(endOffset));
+        streamoff regionSize = (endOffset - startOffset) / regionCount;
+        uniform_int_distribution<streamoff> distribution(0, regionSize - 1);
+        FrameNumber sampledFrameCount = 1;
+        streamoff sampledSize = 0;
+        for (
+            unsigned int region = 0;
+            region < regionCount && attributeSet.isWholeFile();
+            ++region)
+        {
+            offset =
+                stream.resync(
+                startOffset + region * regionSize + distribution(random)
+                );
+            for (
+                int index = 0;
+                index < FramesPerSampleRegion &&
+                offset >= 0 &&
+                offset < endOffset &&
+                stream.readBuffer(offset, 4);
+                ++index)
+            {
+                MP3FrameHeader header = MP3FrameHeader(stream.buffer);
+                if (!MP3FrameHeader::isValid(header)) break;
+                size_t size = header.getFrameSize();
+                if (size == 0) break;
+                header.applyAttributes(MP3AttributeSet(), false, attributeSet);
+                ++sampledFrameCount;
+                sampledSize += size;
+                offset += size;
+            }
+        }
+
+        // The number of frames is taken from a VBR header, or estimated from
+        // the mean size of the frames read, or else from the size of the
+        // smallest frames.
+        MP3VBRHeader vbrHeader;
+        double frameCount;
+        if (
+            stream.readVBRHeader(startOffset, vbrHeader) &&
+            vbrHeader.frameCount != 0)
+            frameCount = vbrHeader.frameCount + 1.0;
+        else if (sampledSize != 0)
+        {
+            frameCount =
+                static_cast<double>(endOffset - startOffset) *
+                (sampledFrameCount - 1) / sampledSize;
+        }
+        else
+        {
+            frameCount =
+                static_cast<double>((endOffset - startOffset) / MinFrameSize);
+        }
+        sampledShare = min(sampledFrameCount / frameCount, 1.0);
+        return attributeSet;
     }
 
-    bool MP3GearWheel::isSkipTest() const
+    void
+        MP3GearWheel::setAttributeSetToApply(
+        MP3AttributeSet attributeSetToApply)
     {
-        return skipTest;
+        if (!MP3AttributeSet::isValid(attributeSetToApply))
+            throw invalid_argument("MP3AttributeSet invalid");
+        this->attributeSetToApply = attributeSetToApply;
     }
 
-    MP3AttributeSet MP3GearWheel::readAttributes(const xstring & filePath)
+    void
+        MP3GearWheel::setAttributeSetToMatch(
+        MP3AttributeSet attributeSetToMatch)
     {
-        return readAttributes(filePath, attributeSetToApply.isWholeFile());
+        if (!MP3AttributeSet::isValid(attributeSetToMatch))
+            throw invalid_argument("MP3AttributeSet invalid");
+        this->attributeSetToMatch = attributeSetToMatch;
     }
 
-    MP3AttributeSet
-        MP3GearWheel::readAttributes(const xstring & filePath, bool wholeFile)
+    void MP3GearWheel::setEarlyExit(bool earlyExit)
     {
-        MP3AttributeSet attributeSetToApply;
-        attributeSetToApply.setWholeFile(wholeFile);
-        return applyAttributes(filePath, attributeSetToApply, true);
+        this->earlyExit = earlyExit;
     }
 
     void
-        MP3GearWheel::setAttributeSetToApply(
-        MP3AttributeSet attributeSetToApply)
+        MP3GearWheel::setFrameIndexCache(
+        shared_ptr<MP3FrameIndexCache> frameIndexCache)
     {
-        if (!MP3AttributeSet::isValid(attributeSetToApply))
-            throw invalid_argument("MP3AttributeSet invalid");
-        this->attributeSetToApply = attributeSetToApply;
+        this->frameIndexCache = frameIndexCache;
+    }
+
+    void MP3GearWheel::setKeyFrameApproximate(bool keyFrameApproximate)
+    {
+        this->keyFrameApproximate = keyFrameApproximate;
     }
 
     void MP3GearWheel::setKeyFrameNumber(FrameNumber keyFrameNumber)
@@ -542,6 +1711,26 @@ namespace MP3epoc
         this->keyFrameNumber = keyFrameNumber;
     }
 
+    void MP3GearWheel::setReadMode(MP3ReadMode readMode)
+    {
+        if (readMode == MP3ReadMode::Piped)
+            throw invalid_argument("Read mode must not be Piped");
+        this->readMode = readMode;
+    }
+
+    void MP3GearWheel::setReadWindowSize(size_t readWindowSize)
+    {
+        if (readWindowSize == 0)
+            throw invalid_argument("Read window size must be > 0");
+        this->readWindowSize = readWindowSize;
+    }
+
+    void
+        MP3GearWheel::setResultCache(shared_ptr<MP3ResultCache> resultCache)
+    {
+        this->resultCache = resultCache;
+    }
+
     void MP3GearWheel::setSkipTest(bool skipTest)
     {
         this->skipTest = skipTest;
@@ -550,7 +1739,74 @@ namespace MP3epoc
     // MP3Stream ///////////////////////////////////////////////////////////////
 
     MP3Stream::MP3Stream(const xstring & path, openmode access):
-        fstream(path, access), path(path), size(calculateSize())
+        MP3Stream(path, access, MP3ReadMode::Stream)
+    { }
+
+    MP3Stream::MP3Stream(uint8_t data[], size_t size):
+        size(static_cast<streamsize>(size)),
+        readMode(MP3ReadMode::MemoryMapped),
+        mappedData(data),
+        windowOffset(0),
+        windowLength(0),
+        windowSize(0),
+        maxWindowSize(0),
+        input(nullptr),
+        output(nullptr),
+        inputEnded(false),
+        position(0),
+        tailData(nullptr),
+        tailOffset(0),
+        tailLength(0),
+        patchesDeferred(false)
+    { }
+
+    MP3Stream::MP3Stream(
+        const xstring & path,
+        openmode access,
+        MP3ReadMode readMode,
+        size_t maxWindowSize):
+        fstream(path, access),
+        path(path),
+        size(calculateSize()),
+        readMode(readMode),
+        mappedData(nullptr),
+        windowOffset(0),
+        windowLength(0),
+        windowSize(0),
+        maxWindowSize(maxWindowSize),
+        input(nullptr),
+        output(nullptr),
+        inputEnded(false),
+        position(0),
+        tailData(nullptr),
+        tailOffset(0),
+        tailLength(0),
+        patchesDeferred(false)
+    {
+        if (readMode == MP3ReadMode::MemoryMapped && !mapFile(access))
+            this->readMode = MP3ReadMode::Windowed;
+    }
+
+    MP3Stream::MP3Stream(
+        const xstring & path,
+        istream & input,
+        ostream * output):
+        path(path),
+        size(numeric_limits<streamsize>::max()),
+        readMode(MP3ReadMode::Piped),
+        mappedData(nullptr),
+        windowOffset(0),
+        windowLength(0),
+        windowSize(0),
+        maxWindowSize(0),
+        input(&input),
+        output(output),
+        inputEnded(false),
+        position(0),
+        tailData(nullptr),
+        tailOffset(0),
+        tailLength(0),
+        patchesDeferred(false)
     { }
 
     bool
@@ -591,8 +1847,44 @@ namespace MP3epoc
         return size;
     }
 
-    NonFramedDataFlags MP3Stream::findTrailingData(streamoff minStartOffset)
+    // Drops the pending patches without writing them.
+    void MP3Stream::discardPatches()
+    {
+        patches.clear();
+    }
+
+    NonFramedDataFlags
+        MP3Stream::findTrailingData(
+        streamoff minStartOffset,
+        streamoff & endOffset)
     {
+        // A pipe is read up to its end first, keeping only the end of it.
+        if (readMode == MP3ReadMode::Piped)
+        {
+            while (!inputEnded)
+            {
+                passOn(
+                    windowOffset + static_cast<streamoff>(windowLength) -
+                    PipedTailSize
+                    );
+                readInput();
+            }
+        }
+
+        // Load the end of the file once, and let the tag detectors read from
+        // there.
+        tailOffset =
+            max<streamoff>(size - TailSize, max<streamoff>(minStartOffset, 0));
+        if (readMode == MP3ReadMode::Piped)
+            tailOffset = max(tailOffset, windowOffset);
+        tailLength = readBlock(tailOffset, tail, tailData);
+        if (readMode == MP3ReadMode::Windowed)
+        {
+            // Reading outside the loaded data refills the window.
+            tail.assign(tailData, tailData + tailLength);
+            tailData = tail.data();
+        }
+
         size_t size;
         NonFramedDataFlags flags;
         if ((size = getBravaSoftwareIncTagSize(minStartOffset, false)) != 0)
@@ -642,9 +1934,10 @@ namespace MP3epoc
                 flags   = flags2;
             }
         }
-        clear();
-        // assuming that the last call to exceptions only set badbit
-        seekg(-static_cast<off_type>(size), end);
+        endOffset = this->size - static_cast<streamoff>(size);
+
+        // The frames at the end of the file may be changed later.
+        tailLength = 0;
         return flags;
     }
 
@@ -661,7 +1954,7 @@ namespace MP3epoc
         streamoff footerStartOffset = _ID3v1TagStartOffset - 32;
         if (
             footerStartOffset >= minStartOffset &&
-            readBuffer(footerStartOffset, 32) &&
+            readTrailingData(footerStartOffset, 32) &&
             bufferContains(signature, 0))
         {
             int version = buffer[8] | buffer[9] << 8;
@@ -689,7 +1982,7 @@ namespace MP3epoc
                         streamoff headerStartOffset = footerStartOffset - size;
                         if (
                             headerStartOffset >= minStartOffset &&
-                            readBuffer(footerStartOffset, 32) &&
+                            readTrailingData(footerStartOffset, 32) &&
                             bufferContains(signature, 0))
                             return size + 32;
                     }
@@ -708,7 +2001,7 @@ namespace MP3epoc
         streamoff footerStartOffset = _ID3v1TagStartOffset - 48;
         if (
             footerStartOffset >= minStartOffset &&
-            readBuffer(footerStartOffset, 48) &&
+            readTrailingData(footerStartOffset, 48) &&
             bufferContains(
             L"Brava Software Inc.             \ue000.\ue000\ue000            ",
             0))
@@ -717,7 +2010,7 @@ namespace MP3epoc
                 streamoff headerStartOffset = _ID3v1TagStartOffset - size;
                 if (
                     headerStartOffset >= minStartOffset &&
-                    readBuffer(headerStartOffset + 4, 16) &&
+                    readTrailingData(headerStartOffset + 4, 16) &&
                     bufferContains(L"\0\0\0\0\0\0\0\0" L"18273645", 0))
                     return size;
             }
@@ -749,7 +2042,7 @@ namespace MP3epoc
         if (hasID3v1Tag) footerStartOffset -= ID3v1TagSize;
         if (
             footerStartOffset >= minStartOffset &&
-            readBuffer(footerStartOffset, 6 + 9))
+            readTrailingData(footerStartOffset, 6 + 9))
         {
             size_t size, minSize;
 
@@ -776,9 +2069,25 @@ namespace MP3epoc
                     static_cast<size_t>(footerStartOffset - minStartOffset);
                 if (size > maxSize) size = maxSize;
             }
+            if (size < minSize) return 0;
+
+            // If the whole range is loaded, search it in one pass, starting
+            // with the largest size like below.
+            streamoff startOffset = footerStartOffset - size;
+            size_t count = size - minSize + 11;
+            if (isInTail(startOffset, count))
+            {
+                static const char marker[] = "LYRICSBEGIN";
+                const uint8_t * begin = tailData + (startOffset - tailOffset);
+                const uint8_t * end = begin + count;
+                const uint8_t * found = search(begin, end, marker, marker + 11);
+                if (found == end) return 0;
+                return size - (found - begin) + (6 + 9);
+            }
+
             for (; size >= minSize; --size)
                 if (
-                    readBuffer(footerStartOffset - size, 11) &&
+                    readTrailingData(footerStartOffset - size, 11) &&
                     bufferContains(L"LYRICSBEGIN", 0))
                     return size + (6 + 9);
         }
@@ -790,6 +2099,11 @@ namespace MP3epoc
         return path;
     }
 
+    MP3ReadMode MP3Stream::getReadMode() const
+    {
+        return readMode;
+    }
+
     streamsize MP3Stream::getSize() const
     {
         return size;
@@ -800,7 +2114,7 @@ namespace MP3epoc
         streamoff startOffset = size - ID3v1TagSize;
         return
             startOffset >= minStartOffset &&
-            readBuffer(startOffset, 3) &&
+            readTrailingData(startOffset, 3) &&
             bufferContains(L"TAG", 0);
     }
 
@@ -809,22 +2123,205 @@ namespace MP3epoc
         streamoff startOffset = size - (ID3v1TagSize + MGIXTagSize);
         return
             startOffset >= minStartOffset &&
-            readBuffer(startOffset, 4) &&
+            readTrailingData(startOffset, 4) &&
             bufferContains(L"MGIX", 0);
     }
 
-    bool MP3Stream::read(uint8_t * dest, size_t count)
+    // Makes the data from offset on available in the window in Piped mode,
+    // passing on all the data before it but for the last PipedTailSize bytes.
+    // Returns false if the data has been passed on already, or if the input
+    // ends before count bytes.
+    bool MP3Stream::fillPipe(streamoff offset, size_t count)
     {
-        return
-            static_cast<bool>
-            (fstream::read(reinterpret_cast<char *>(dest), count));
+        if (offset < windowOffset) return false;
+        streamoff endOffset = offset + static_cast<streamoff>(count);
+        while (
+            windowOffset + static_cast<streamoff>(windowLength) < endOffset &&
+            !inputEnded)
+        {
+            passOn(offset - PipedTailSize);
+            readInput();
+        }
+        return isInWindow(offset, count);
     }
 
-    bool MP3Stream::readBuffer(streamoff offset, size_t count)
+    bool MP3Stream::mapFile(openmode access)
     {
+        mappedFile.reset(new MemoryMappedFile(path, (access & out) != 0));
+        uint8_t * data = mappedFile->getData();
+
+        // If the file was resized in the meantime, don't use the mapping.
+        if (
+            data == nullptr ||
+            static_cast<streamsize>(mappedFile->getSize()) != size)
+        {
+            mappedFile.reset();
+            return false;
+        }
+        mappedData = data;
+        return true;
+    }
+
+    bool MP3Stream::fillWindow(streamoff offset, size_t count)
+    {
+        // Grow the window while the file is read sequentially, and start over
+        // with a small window after a random access.
+        if (
+            windowLength != 0 &&
+            offset >= windowOffset &&
+            offset <= windowOffset + static_cast<streamoff>(windowLength))
+            windowSize = min(windowSize * 2, maxWindowSize);
+        else
+            windowSize = min(InitialWindowSize, maxWindowSize);
+        if (windowSize < count) windowSize = count;
+
+        // Near the end of the file, move the window back to cover the end of
+        // the file, so that the probes for trailing tags need only one fill.
+        streamoff startOffset = offset;
+        if (size - startOffset < static_cast<streamoff>(windowSize))
+            startOffset =
+            max<streamoff>(size - static_cast<streamoff>(windowSize), 0);
+
+        if (window.size() < windowSize) window.resize(windowSize);
         clear();
         exceptions(badbit);
-        seekg(offset);
+        seekg(startOffset);
+        fstream::read(
+            reinterpret_cast<char *>(window.data()),
+            min<streamoff>(size - startOffset, windowSize)
+            );
+        windowOffset = startOffset;
+        windowLength = static_cast<size_t>(gcount());
+        return isInWindow(offset, count);
+    }
+
+    bool MP3Stream::isInWindow(streamoff offset, size_t count) const
+    {
+        return
+            offset >= windowOffset &&
+            offset - windowOffset <=
+            static_cast<streamoff>(windowLength) -
+            static_cast<streamoff>(count);
+    }
+
+    bool MP3Stream::isInTail(streamoff offset, size_t count) const
+    {
+        return
+            offset >= tailOffset &&
+            offset - tailOffset <=
+            static_cast<streamoff>(tailLength) -
+            static_cast<streamoff>(count);
+    }
+
+    bool MP3Stream::isInRange(streamoff offset, size_t count) const
+    {
+        return
+            offset >= 0 &&
+            offset <= size &&
+            count <= static_cast<size_t>(size - offset);
+    }
+
+    // Drops the data before offset from the window in Piped mode, writing it to
+    // the output.
+    void MP3Stream::passOn(streamoff offset)
+    {
+        if (offset <= windowOffset || windowLength == 0) return;
+        size_t count =
+            static_cast<size_t>(
+            min<streamoff>(offset - windowOffset, windowLength)
+            );
+        if (output != nullptr)
+        {
+            output->write(reinterpret_cast<const char *>(window.data()), count);
+            if (output->fail()) throw failure("MP3Stream output failed");
+        }
+        memmove(window.data(), window.data() + count, windowLength - count);
+        windowOffset += count;
+        windowLength -= count;
+    }
+
+    void MP3Stream::patchBuffer(streamoff offset, size_t count)
+    {
+        // The data of a pipe will not be there any more later.
+        if (readMode == MP3ReadMode::Piped)
+        {
+            writeBuffer(offset, count);
+            return;
+        }
+
+        Patch patch;
+        patch.offset = offset;
+        patch.count = count;
+        memcpy(patch.data, buffer, count);
+        patches.push_back(patch);
+        if (!patchesDeferred && patches.size() >= MaxPendingPatches)
+            writePatches();
+    }
+
+    bool MP3Stream::read(uint8_t * dest, size_t count)
+    {
+        const uint8_t * src;
+        switch (readMode)
+        {
+        case MP3ReadMode::Stream:
+            return
+                static_cast<bool>
+                (fstream::read(reinterpret_cast<char *>(dest), count));
+        case MP3ReadMode::MemoryMapped:
+            if (!isInRange(position, count)) return false;
+            src = mappedData + position;
+            break;
+        case MP3ReadMode::Windowed:
+            if (
+                !isInRange(position, count) ||
+                (!isInWindow(position, count) && !fillWindow(position, count)))
+                return false;
+            src = window.data() + (position - windowOffset);
+            break;
+        case MP3ReadMode::Piped:
+            if (
+                !isInRange(position, count) ||
+                (!isInWindow(position, count) && !fillPipe(position, count)))
+                return false;
+            src = window.data() + (position - windowOffset);
+            break;
+        DEFAULT_UNREACHABLE;
+        }
+        memcpy(dest, src, count);
+        position += count;
+        return true;
+    }
+
+    // Appends the next block of the input to the window in Piped mode. Once
+    // the end of the input is reached, the size becomes known.
+    void MP3Stream::readInput()
+    {
+        if (window.size() < windowLength + PipedReadSize)
+            window.resize(windowLength + PipedReadSize);
+        input->read(
+            reinterpret_cast<char *>(window.data() + windowLength),
+            PipedReadSize
+            );
+        size_t count = static_cast<size_t>(input->gcount());
+        windowLength += count;
+        if (count < PipedReadSize)
+        {
+            if (input->bad()) throw failure("MP3Stream input failed");
+            inputEnded = true;
+            size = windowOffset + static_cast<streamoff>(windowLength);
+        }
+    }
+
+    bool MP3Stream::readBuffer(streamoff offset, size_t count)
+    {
+        if (readMode == MP3ReadMode::Stream)
+        {
+            clear();
+            exceptions(badbit);
+            seekg(offset);
+        }
+        else
+            position = offset;
         return read(buffer, count);
     }
 
@@ -837,22 +2334,113 @@ namespace MP3epoc
         return protectedSize;
     }
 
+    // Loads only the CRC of the frame at the specified offset, whose header
+    // must have been read last. Returns 0 like readProtectedData if the
+    // protected data is incomplete.
+    int MP3Stream::readStoredCRC(streamoff offset, MP3FrameHeader header)
+    {
+        int protectedSize = header.getProtectedSize();
+        if (
+            protectedSize > 0 &&
+            (!isInRange(offset, protectedSize) || !read(buffer + 4, 2)))
+            return 0;
+        return protectedSize;
+    }
+
+    // Parses the VBR header in the frame at the specified offset, if any. The
+    // frame header is left in the buffer.
+    bool MP3Stream::readVBRHeader(streamoff offset, MP3VBRHeader & vbrHeader)
+    {
+        if (!readBuffer(offset, 4)) return false;
+        MP3FrameHeader header = MP3FrameHeader(buffer);
+        if (!MP3FrameHeader::isValid(header)) return false;
+        size_t size = header.getFrameSize();
+        if (size < 4) return false;
+
+        vector<uint8_t> frame(size);
+        memcpy(frame.data(), buffer, 4);
+        return
+            read(frame.data() + 4, size - 4) &&
+            MP3VBRHeader::parse(frame.data(), size, vbrHeader);
+    }
+
+    // Makes the data from the specified offset up to the end of the file, or
+    // at least 4 bytes of it, available at data. Returns the number of bytes
+    // available, or 0 if there are less than 4.
+    size_t MP3Stream::readBlock(
+        streamoff offset,
+        vector<uint8_t> & storage,
+        const uint8_t * & data)
+    {
+        if (!isInRange(offset, 4)) return 0;
+        switch (readMode)
+        {
+        case MP3ReadMode::Stream:
+            storage.resize(
+                static_cast<size_t>(
+                min<streamoff>(size - offset, ScanBlockSize)
+                )
+                );
+            clear();
+            exceptions(badbit);
+            seekg(offset);
+            fstream::read(
+                reinterpret_cast<char *>(storage.data()),
+                storage.size()
+                );
+            data = storage.data();
+            return static_cast<size_t>(gcount());
+        case MP3ReadMode::MemoryMapped:
+            data = mappedData + offset;
+            return static_cast<size_t>(size - offset);
+        case MP3ReadMode::Windowed:
+            if (!isInWindow(offset, 4) && !fillWindow(offset, 4)) return 0;
+            data = window.data() + (offset - windowOffset);
+            return windowLength - static_cast<size_t>(offset - windowOffset);
+        case MP3ReadMode::Piped:
+            if (!isInWindow(offset, 4) && !fillPipe(offset, 4)) return 0;
+            data = window.data() + (offset - windowOffset);
+            return windowLength - static_cast<size_t>(offset - windowOffset);
+        DEFAULT_UNREACHABLE;
+        }
+    }
+
+    // Like readBuffer, but takes the data from the end of the file loaded by
+    // findTrailingData where possible.
+    bool MP3Stream::readTrailingData(streamoff offset, size_t count)
+    {
+        if (!isInTail(offset, count)) return readBuffer(offset, count);
+        memcpy(buffer, tailData + (offset - tailOffset), count);
+        return true;
+    }
+
     streamoff MP3Stream::resync(streamoff offset)
     {
-        streamoff currentOffset;
-        MP3FrameHeader header;
-        for (currentOffset = offset;; ++currentOffset)
+        streamoff currentOffset = offset;
+        vector<uint8_t> storage;
+        for (;;)
         {
+            const uint8_t * data;
+            size_t count = readBlock(currentOffset, storage, data);
+
             // End of file? Fail!
-            if (!readBuffer(currentOffset, 4)) return -1;
+            if (count < 4) return -1;
 
             // Valid frame header found? Go to next step.
-            header = MP3FrameHeader(buffer);
-            if (MP3FrameHeader::isValid(header)) break;
+            size_t index = findFrameHeader(data, count);
+            if (index < count)
+            {
+                currentOffset += index;
+                break;
+            }
 
-            // Nothing found yet, so loop once more.
+            // Nothing found yet, so go on where a header could still start.
+            currentOffset += count - 3;
         }
 
+        readBuffer(currentOffset, 4);
+        MP3FrameHeader header = MP3FrameHeader(buffer);
+
         streamoff nextOffset = currentOffset;
         for (int index = 0; index < 3; ++index)
         {
@@ -876,19 +2464,137 @@ namespace MP3epoc
         return currentOffset;
     }
 
+    void MP3Stream::setPatchesDeferred(bool patchesDeferred)
+    {
+        this->patchesDeferred = patchesDeferred;
+    }
+
     void MP3Stream::write(const uint8_t * src, size_t count)
     {
-        fstream::write(reinterpret_cast<const char *>(src), count);
+        switch (readMode)
+        {
+        case MP3ReadMode::MemoryMapped:
+            if (!isInRange(position, count))
+                throw failure("MP3Stream write out of range");
+            memcpy(mappedData + position, src, count);
+            break;
+        case MP3ReadMode::Piped:
+            if (!isInWindow(position, count))
+                throw failure("MP3Stream write out of window");
+            memcpy(window.data() + (position - windowOffset), src, count);
+            break;
+        case MP3ReadMode::Windowed:
+            {
+                // Keep the window consistent with the file.
+                streamoff windowEnd = windowOffset + windowLength;
+                streamoff begin = max(position, windowOffset);
+                streamoff end =
+                    min(position + static_cast<streamoff>(count), windowEnd);
+                if (begin < end)
+                    memcpy(
+                        window.data() + (begin - windowOffset),
+                        src + (begin - position),
+                        static_cast<size_t>(end - begin)
+                        );
+            }
+            // fall through
+        case MP3ReadMode::Stream:
+            fstream::write(reinterpret_cast<const char *>(src), count);
+            break;
+        DEFAULT_UNREACHABLE;
+        }
+        position += count;
     }
 
     void MP3Stream::writeBuffer(streamoff offset, size_t count)
     {
-        clear();
-        exceptions(failbit | badbit);
-        seekp(offset);
+        if (
+            readMode == MP3ReadMode::Stream ||
+            readMode == MP3ReadMode::Windowed)
+        {
+            clear();
+            exceptions(failbit | badbit);
+            seekp(offset);
+        }
+        position = offset;
         write(buffer, count);
     }
 
+    void MP3Stream::writePatches()
+    {
+        // Without an output, the rest of a pipe need not be read.
+        if (readMode == MP3ReadMode::Piped)
+        {
+            if (output == nullptr) return;
+            for (;;)
+            {
+                passOn(windowOffset + static_cast<streamoff>(windowLength));
+                if (inputEnded) return;
+                readInput();
+            }
+        }
+
+        stable_sort(
+            patches.begin(),
+            patches.end(),
+            [] (const Patch & patch1, const Patch & patch2)
+            {
+                return patch1.offset < patch2.offset;
+            }
+            );
+
+        // A memory-mapped view is patched in place, so merging patches into
+        // blocks would only copy more data.
+        streamoff maxGap =
+            readMode == MP3ReadMode::MemoryMapped ? -1 : MaxPatchGap;
+
+        vector<uint8_t> block;
+        auto patchIterator = patches.cbegin();
+        while (patchIterator != patches.cend())
+        {
+            auto blockBegin = patchIterator;
+            streamoff blockStartOffset = patchIterator->offset;
+            streamoff blockEndOffset = blockStartOffset + patchIterator->count;
+            while (++patchIterator != patches.cend())
+            {
+                streamoff patchEndOffset =
+                    patchIterator->offset + patchIterator->count;
+                if (
+                    patchIterator->offset - blockEndOffset > maxGap ||
+                    patchEndOffset - blockStartOffset > MaxPatchBlockSize)
+                    break;
+                if (patchEndOffset > blockEndOffset)
+                    blockEndOffset = patchEndOffset;
+            }
+
+            if (patchIterator - blockBegin == 1)
+            {
+                memcpy(buffer, blockBegin->data, blockBegin->count);
+                writeBuffer(blockStartOffset, blockBegin->count);
+                continue;
+            }
+
+            // Read the whole block, apply the patches and write it back.
+            size_t blockSize =
+                static_cast<size_t>(blockEndOffset - blockStartOffset);
+            block.resize(blockSize);
+            clear();
+            exceptions(failbit | badbit);
+            seekg(blockStartOffset);
+            fstream::read(reinterpret_cast<char *>(block.data()), blockSize);
+            for (auto patch = blockBegin; patch != patchIterator; ++patch)
+                memcpy(
+                    block.data() + (patch->offset - blockStartOffset),
+                    patch->data,
+                    patch->count
+                    );
+            seekp(blockStartOffset);
+            position = blockStartOffset;
+            write(block.data(), blockSize);
+        }
+        patches.clear();
+    }
+
     // NonFramedDataFlags //////////////////////////////////////////////////////
 
     NonFramedDataFlags
@@ -1,13 +1,24 @@
 #pragma once
 
 #include "FrameNumber.h"
+#include "MemoryMappedFile.h"
 #include "MP3AttributeSet.h"
 
 #include <cstdint>
+#include <exception>
 #include <fstream>
+#include <istream>
+#include <memory>
+#include <ostream>
+#include <vector>
 
 namespace MP3epoc
 {
+    class MP3FrameIndexCache;
+    class MP3ResultCache;
+    struct MP3FrameIndex;
+    struct MP3VBRHeader;
+
     enum NonFramedDataFlags
     {
         ID3v2Tag                = 0x01,
@@ -27,6 +38,25 @@ namespace MP3epoc
         ID3v1Tag | BravaSoftwareIncTag | Lyrics3Tag | ApeTag,
     };
 
+    // Specifies how an MP3Stream reads the data of a file.
+    enum class MP3ReadMode
+    {
+        // Every read request is served by a seek and a read on the stream.
+        Stream,
+        // Read requests are served directly from a memory-mapped view of the
+        // file. If the file cannot be mapped, Windowed mode is used instead.
+        MemoryMapped,
+        // Read requests are served from a read-ahead window that is only
+        // refilled on a miss. The window grows while the file is read
+        // sequentially, up to a configurable size.
+        Windowed,
+        // The data is read once, forward, from an input stream, and passed on
+        // to an output stream as soon as it has left a window that keeps the
+        // end of the data read. Only streams constructed from an input stream
+        // use this mode.
+        Piped,
+    };
+
     NonFramedDataFlags
         operator ^ (NonFramedDataFlags value1, NonFramedDataFlags value2);
 
@@ -55,6 +85,11 @@ namespace MP3epoc
             bool isKeyFrame,
             MP3AttributeSet & attributeSetToUpdate
             );
+        // Calculate the sizes from the header fields. getFrameSize and
+        // getProtectedSize look up the same values in precalculated tables.
+        size_t calculateFrameSize() const;
+        bool calculateMeanFrameSize(int & numerator, int & denominator) const;
+        int calculateProtectedSize() const;
         size_t getFrameSize() const;
         int getProtectedSize() const;
         static bool isValid(MP3FrameHeader header);
@@ -93,9 +128,32 @@ namespace MP3epoc
     class MP3Stream: public std::fstream
     {
     public:
+        static const size_t DefaultWindowSize = 0x100000;
         uint8_t buffer[48];
         MP3Stream(const std::xstring & path, openmode access);
-        NonFramedDataFlags findTrailingData(streamoff minStartOffset);
+        MP3Stream(
+            const std::xstring & path,
+            openmode access,
+            MP3ReadMode readMode,
+            size_t maxWindowSize = DefaultWindowSize
+            );
+        // Serves all requests from data, like a memory-mapped view of a file
+        // of the specified size. The data must outlive the stream, and its
+        // path is empty.
+        MP3Stream(uint8_t data[], size_t size);
+        // Reads the data from input in Piped mode, and passes it on to output,
+        // if not null. Patches are applied as soon as they are made, and
+        // writePatches passes on all the data left, up to the end of input.
+        // Data that has been passed on cannot be read again. The size is only
+        // known once the end of input has been read.
+        MP3Stream(
+            const std::xstring & path,
+            std::istream & input,
+            std::ostream * output
+            );
+        void discardPatches();
+        NonFramedDataFlags
+            findTrailingData(streamoff minStartOffset, streamoff & endOffset);
         size_t getApeTagSize(streamoff minStartOffset, bool hasID3v1Tag);
         size_t getBravaSoftwareIncTagSize(
             streamoff minStartOffset,
@@ -104,22 +162,79 @@ namespace MP3epoc
         size_t getID3v2TagSize();
         size_t getLyrics3TagSize(streamoff minStartOffset, bool hasID3v1Tag);
         const std::xstring & getPath() const;
+        MP3ReadMode getReadMode() const;
         std::streamsize getSize() const;
         bool hasID3v1Tag(streamoff minStartOffset);
         bool hasMGIXTag(streamoff minStartOffset);
+        void patchBuffer(streamoff offset, size_t count);
+        size_t readBlock(
+            streamoff offset,
+            std::vector<uint8_t> & storage,
+            const uint8_t * & data
+            );
         bool readBuffer(streamoff offset, size_t count);
         int readProtectedData(MP3FrameHeader header);
+        int readStoredCRC(streamoff offset, MP3FrameHeader header);
+        bool readVBRHeader(streamoff offset, MP3VBRHeader & vbrHeader);
         streamoff resync(streamoff offset);
+        // If patches are deferred, they are only written by writePatches, no
+        // matter how many of them are pending.
+        void setPatchesDeferred(bool patchesDeferred);
         void writeBuffer(streamoff offset, size_t count);
+        void writePatches();
     private:
+        struct Patch
+        {
+            streamoff offset;
+            size_t count;
+            uint8_t data[6];
+        };
+
         const std::xstring path;
-        const std::streamsize size;
+        std::streamsize size;
+        MP3ReadMode readMode;
+        std::unique_ptr<MemoryMappedFile> mappedFile;
+        uint8_t * mappedData;
+        std::vector<uint8_t> window;
+        streamoff windowOffset;
+        size_t windowLength;
+        size_t windowSize;
+        const size_t maxWindowSize;
+        std::istream * input;
+        std::ostream * output;
+        bool inputEnded;
+        streamoff position;
+        std::vector<uint8_t> tail;
+        const uint8_t * tailData;
+        streamoff tailOffset;
+        size_t tailLength;
+        std::vector<Patch> patches;
+        bool patchesDeferred;
         bool bufferContains(const wchar_t signature[], size_t start) const;
         std::streamsize calculateSize();
+        bool fillWindow(streamoff offset, size_t count);
+        bool isInRange(streamoff offset, size_t count) const;
+        bool isInTail(streamoff offset, size_t count) const;
+        bool isInWindow(streamoff offset, size_t count) const;
+        bool fillPipe(streamoff offset, size_t count);
+        bool mapFile(openmode access);
+        void passOn(streamoff offset);
         bool read(uint8_t * dest, size_t count);
+        void readInput();
+        bool readTrailingData(streamoff offset, size_t count);
         void write(const uint8_t * src, size_t count);
     };
 
+    // The result of processing one file of a batch. If the file could not be
+    // processed, exception holds the exception thrown, and the other fields
+    // are unspecified.
+    struct MP3FileResult
+    {
+        MP3AttributeSet attributeSet;
+        NonFramedDataFlags nonFramedDataFlags;
+        std::exception_ptr exception;
+    };
+
     class MP3GearWheel
     {
     public:
@@ -129,14 +244,108 @@ namespace MP3epoc
         explicit MP3GearWheel(bool skipTest);
         MP3GearWheel(MP3AttributeSet attributeSetToApply, bool skipTest);
         MP3AttributeSet applyAttributes(const std::xstring & filePath);
+        // The overloads taking data process a file held in memory, in place.
+        MP3AttributeSet applyAttributes(uint8_t data[], size_t size);
+        // The overloads taking streams process a file read from input in a
+        // single forward pass, writing it to output as they go. Trailing tags
+        // are only recognized if they fit in the data kept at the end, and a
+        // file that fails the test is left incomplete in output. name stands
+        // for the path of the file in exceptions.
+        MP3AttributeSet
+            applyAttributes(
+            std::istream & input,
+            std::ostream & output,
+            const std::xstring & name
+            );
+        // The overloads taking a list of paths process the files on
+        // threadCount threads, or on one thread per processor if threadCount
+        // is 0, each thread using its own clone of the gear wheel. The results
+        // are returned in the order of filePaths. Errors processing a file are
+        // stored in its result rather than thrown.
+        std::vector<MP3FileResult>
+            applyAttributes(
+            const std::vector<std::xstring> & filePaths,
+            unsigned int threadCount
+            ) const;
+        // Returns a copy of the gear wheel of the same type. Subclasses must
+        // override it, so that the copies used on other threads keep their
+        // behavior.
+        virtual std::unique_ptr<MP3GearWheel> clone() const;
         MP3AttributeSet getAttributeSetToApply() const;
+        MP3AttributeSet getAttributeSetToMatch() const;
+        std::shared_ptr<MP3FrameIndexCache> getFrameIndexCache() const;
         FrameNumber getKeyFrameNumber() const;
+        MP3ReadMode getReadMode() const;
+        size_t getReadWindowSize() const;
+        std::shared_ptr<MP3ResultCache> getResultCache() const;
+        bool isEarlyExit() const;
+        bool isKeyFrameApproximate() const;
         bool isSkipTest() const;
         MP3AttributeSet readAttributes(const std::xstring & filePath);
         MP3AttributeSet
             readAttributes(const std::xstring & filePath, bool wholeFile);
+        MP3AttributeSet readAttributes(const uint8_t data[], size_t size);
+        MP3AttributeSet
+            readAttributes(const uint8_t data[], size_t size, bool wholeFile);
+        MP3AttributeSet
+            readAttributes(std::istream & input, const std::xstring & name);
+        std::vector<MP3FileResult>
+            readAttributes(
+            const std::vector<std::xstring> & filePaths,
+            unsigned int threadCount
+            ) const;
+        // Reads the VBR header in the first frame of filePath. Returns false
+        // if there is none, or if it does not match the frames of the file.
+        bool
+            readVBRHeader(
+            const std::xstring & filePath,
+            MP3VBRHeader & vbrHeader
+            );
+        // Estimates the whole-file attributes of filePath from the key frame
+        // and from a few frames in each of regionCount regions at random
+        // offsets, so that the amount of data read does not depend on the
+        // size of the file. sampledShare is set to the estimated share of the
+        // frames that were read: the lower it is, the more likely it is that
+        // frames with different attributes were missed. Files too small to
+        // be sampled are read in whole, with a share of 1.
+        MP3AttributeSet
+            sampleAttributes(
+            const std::xstring & filePath,
+            unsigned int regionCount,
+            double & sampledShare
+            );
         void setAttributeSetToApply(MP3AttributeSet attributeSet);
+        // With early exit, a whole-file read also stops as soon as its result
+        // can no longer match this set. The result returned then is only
+        // meaningful as a non-match.
+        void setAttributeSetToMatch(MP3AttributeSet attributeSet);
+        // With early exit, whole-file reads stop as soon as their result
+        // cannot change any more, that is once the key frame has been read
+        // and every attribute has been found to vary. Unknown data after the
+        // last frame is then not detected.
+        void setEarlyExit(bool earlyExit);
+        // If a frame index cache is set, the layout of the files whose frames
+        // are all processed is kept there, and files that have not changed
+        // since are processed without looking for tags and nonframed data.
+        void
+            setFrameIndexCache(
+            std::shared_ptr<MP3FrameIndexCache> frameIndexCache
+            );
+        // Reads that are not whole-file skip the frames before a key frame
+        // deep in the file, if its offset is found in a cached frame index,
+        // or if an Info header confirms that the file has a constant bitrate.
+        // Otherwise, if key frames may be approximate, the frame where the key
+        // frame would be at a constant bitrate, or a frame near the key frame
+        // located with the table of contents of a VBR header, is used instead.
+        // The results of such reads are not cached.
+        void setKeyFrameApproximate(bool keyFrameApproximate);
         void setKeyFrameNumber(FrameNumber keyFrameNumber);
+        void setReadMode(MP3ReadMode readMode);
+        void setReadWindowSize(size_t readWindowSize);
+        // If a result cache is set, the attributes read from a file are kept
+        // there, and returned without opening the file again as long as it
+        // is unchanged. Applying attributes does not use the cache.
+        void setResultCache(std::shared_ptr<MP3ResultCache> resultCache);
         void setSkipTest(bool skipTest);
     protected:
         NonFramedDataFlags nonFramedDataField;
@@ -148,7 +357,14 @@ namespace MP3epoc
             );
     private:
         MP3AttributeSet attributeSetToApply;
+        MP3AttributeSet attributeSetToMatch;
+        bool earlyExit;
+        std::shared_ptr<MP3FrameIndexCache> frameIndexCache;
+        bool keyFrameApproximate;
         FrameNumber keyFrameNumber;
+        MP3ReadMode readMode;
+        size_t readWindowSize;
+        std::shared_ptr<MP3ResultCache> resultCache;
         bool skipTest;
         MP3AttributeSet
             applyAttributes(
@@ -156,5 +372,63 @@ namespace MP3epoc
             MP3AttributeSet attributeSetToApply,
             bool keyFrameRequired
             );
+        MP3AttributeSet
+            applyAttributes(
+            uint8_t data[],
+            size_t size,
+            MP3AttributeSet attributeSetToApply,
+            bool keyFrameRequired
+            );
+        MP3AttributeSet
+            applyAttributes(
+            std::istream & input,
+            std::ostream * output,
+            const std::xstring & name,
+            MP3AttributeSet attributeSetToApply,
+            bool keyFrameRequired
+            );
+        void
+            findFrames(
+            MP3Stream & stream,
+            std::streamoff & startOffset,
+            std::streamoff & endOffset
+            );
+        std::streamoff
+            locateKeyFrame(
+            MP3Stream & stream,
+            std::streamoff startOffset,
+            std::streamoff endOffset,
+            FrameNumber & frameNumber
+            );
+        std::vector<MP3FileResult>
+            processFiles(
+            const std::vector<std::xstring> & filePaths,
+            bool applying,
+            unsigned int threadCount
+            ) const;
+        MP3AttributeSet
+            processStream(
+            const std::xstring & filePath,
+            MP3AttributeSet attributeSetToApply,
+            bool keyFrameRequired,
+            const MP3FrameIndex * knownFrameIndex,
+            MP3FrameIndex * foundFrameIndex
+            );
+        MP3AttributeSet
+            processStream(
+            MP3Stream & stream,
+            MP3AttributeSet attributeSetToApply,
+            bool keyFrameRequired,
+            const MP3FrameIndex * knownFrameIndex,
+            MP3FrameIndex * foundFrameIndex
+            );
+        MP3AttributeSet
+            sampleFrames(
+            MP3Stream & stream,
+            std::streamoff startOffset,
+            std::streamoff endOffset,
+            unsigned int regionCount,
+            double & sampledShare
+            );
     };
 }
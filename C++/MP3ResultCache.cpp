@@ -0,0 +1,300 @@
+#include "MP3ResultCache.h"
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+using namespace MP3epoc;
+using namespace std;
+
+namespace
+{
+    const char CacheFileSignature[] =
+    {
+        'M', 'P', '3', 'R', 'S', 'L', 'T', '1'
+    };
+
+    const size_t InitialSlotCount = 0x1000;
+
+#if defined(_WIN32)
+
+    const xchar DirSeparator = L'\\';
+
+#else // #if defined(_WIN32)
+
+    const xchar DirSeparator = '/';
+
+#endif // #if defined(_WIN32)
+
+    uint32_t calculateChecksum(const void * data, size_t size);
+    size_t hashFileNumber(uint64_t device, uint64_t fileNumber);
+
+    // Calculates the FNV-1a hash of data. The result is never 0.
+    uint32_t calculateChecksum(const void * data, size_t size)
+    {
+        const uint8_t * bytes = static_cast<const uint8_t *>(data);
+        uint32_t hash = 0x811c9dc5;
+        for (size_t index = 0; index < size; ++index)
+        {
+            hash ^= bytes[index];
+            hash *= 0x01000193;
+        }
+        return hash != 0 ? hash : 1;
+    }
+
+    // Mixes the bits of the device and the file number, since file numbers
+    // are often allocated sequentially.
+    size_t hashFileNumber(uint64_t device, uint64_t fileNumber)
+    {
+        uint64_t hash = device * 0x9e3779b97f4a7c15 ^ fileNumber;
+        hash ^= hash >> 31;
+        hash *= 0xbf58476d1ce4e5b9;
+        hash ^= hash >> 29;
+        return static_cast<size_t>(hash);
+    }
+}
+
+namespace MP3epoc
+{
+    // The cache file consists of a header followed by slotCount slots, which
+    // form a hash table with linear probing. slotCount is a power of 2, and
+    // the table is grown before more than three quarters of it are used.
+    struct MP3ResultCache::Header
+    {
+        char signature[8];
+        uint32_t slotCount;
+        uint32_t usedSlotCount;
+    };
+
+    // A slot is empty if its checksum is 0.
+    struct MP3ResultCache::Slot
+    {
+        uint64_t device;
+        uint64_t fileNumber;
+        uint64_t size;
+        uint64_t modificationTime;
+        uint32_t readSettings;
+        uint32_t attributeSetData;
+        uint32_t nonFramedDataFlags;
+        uint32_t checksum;
+    };
+
+    MP3ResultCache::MP3ResultCache(const xstring & filePath):
+        filePath(filePath),
+        header(nullptr),
+        slots(nullptr),
+        slotCount(0)
+    {
+        size_t dirPathLength = filePath.find_last_of(DirSeparator);
+        if (dirPathLength != xstring::npos && dirPathLength != 0)
+            createDirectories(filePath.substr(0, dirPathLength).c_str());
+        if (!open()) create(InitialSlotCount, nullptr, 0);
+    }
+
+    // Replaces the cache file with one of slotCount slots holding the valid
+    // entries of the oldSlotCount slots oldSlots, and maps it.
+    // The new table is written to a temporary file first, which then replaces
+    // the cache file at once, since truncating a file that other processes
+    // have mapped would make their accesses fail.
+    bool
+        MP3ResultCache::create(
+        size_t slotCount,
+        const Slot * oldSlots,
+        size_t oldSlotCount)
+    {
+        Header newHeader;
+        memcpy(
+            newHeader.signature,
+            CacheFileSignature,
+            sizeof CacheFileSignature
+            );
+        newHeader.slotCount = static_cast<uint32_t>(slotCount);
+        newHeader.usedSlotCount = 0;
+        vector<Slot> newSlots(slotCount);
+        for (size_t index = 0; index < oldSlotCount; ++index)
+        {
+            const Slot & oldSlot = oldSlots[index];
+            if (!isValid(oldSlot)) continue;
+            Slot * slot =
+                findSlot(
+                newSlots.data(),
+                slotCount,
+                oldSlot.device,
+                oldSlot.fileNumber
+                );
+            if (slot == nullptr || slot->checksum != 0) continue;
+            *slot = oldSlot;
+            ++newHeader.usedSlotCount;
+        }
+
+        // A mapped file cannot be replaced on Windows.
+        mappedFile.reset();
+        header = nullptr;
+        slots = nullptr;
+        this->slotCount = 0;
+
+        xstring tempFilePath = getTempFilePath(filePath);
+        bool written;
+        {
+            ofstream stream(tempFilePath.c_str(), ios_base::binary);
+            stream.write(
+                reinterpret_cast<const char *>(&newHeader),
+                sizeof newHeader
+                );
+            stream.write(
+                reinterpret_cast<const char *>(newSlots.data()),
+                slotCount * sizeof(Slot)
+                );
+            stream.close();
+            written = !stream.fail();
+        }
+        if (!written || !replaceFile(tempFilePath.c_str(), filePath.c_str()))
+            removeFile(tempFilePath.c_str());
+        return open();
+    }
+
+    // Returns the slot of the slotCount slots for the specified file, or an
+    // empty slot where it can be stored, or nullptr if the table is full.
+    MP3ResultCache::Slot *
+        MP3ResultCache::findSlot(
+        Slot * slots,
+        size_t slotCount,
+        uint64_t device,
+        uint64_t fileNumber)
+    {
+        size_t mask = slotCount - 1;
+        size_t index = hashFileNumber(device, fileNumber) & mask;
+        for (size_t probeCount = 0; probeCount < slotCount; ++probeCount)
+        {
+            Slot & slot = slots[index];
+            if (
+                slot.checksum == 0 ||
+                (slot.device == device && slot.fileNumber == fileNumber))
+                return &slot;
+            index = (index + 1) & mask;
+        }
+        return nullptr;
+    }
+
+    xstring MP3ResultCache::getDefaultFilePath()
+    {
+        xstring cacheDirPath = getCacheDirPath();
+        if (cacheDirPath.empty()) return cacheDirPath;
+        return cacheDirPath.append(1, DirSeparator).append(XSTR("Results"));
+    }
+
+    const xstring & MP3ResultCache::getFilePath() const
+    {
+        return filePath;
+    }
+
+    // Doubles the number of slots. Damaged entries are dropped.
+    void MP3ResultCache::grow()
+    {
+        create(slotCount * 2, slots, slotCount);
+    }
+
+    // Returns true if slot is neither empty nor damaged.
+    bool MP3ResultCache::isValid(const Slot & slot)
+    {
+        return
+            slot.checksum != 0 &&
+            slot.checksum == calculateChecksum(&slot, offsetof(Slot, checksum));
+    }
+
+    bool
+        MP3ResultCache::load(
+        const FileIdentity & identity,
+        uint32_t readSettings,
+        MP3AttributeSet & attributeSet,
+        NonFramedDataFlags & nonFramedDataFlags)
+    {
+        lock_guard<mutex> lock(slotMutex);
+        if (slots == nullptr) return false;
+
+        const Slot * slot =
+            findSlot(slots, slotCount, identity.device, identity.fileNumber);
+        if (
+            slot == nullptr ||
+            !isValid(*slot) ||
+            slot->size != identity.size ||
+            slot->modificationTime != identity.modificationTime ||
+            slot->readSettings != readSettings)
+            return false;
+        attributeSet = MP3AttributeSet(slot->attributeSetData);
+        nonFramedDataFlags =
+            static_cast<NonFramedDataFlags>(slot->nonFramedDataFlags);
+        return true;
+    }
+
+    // Maps the cache file, if it exists and is valid.
+    bool MP3ResultCache::open()
+    {
+        mappedFile.reset(new MemoryMappedFile(filePath, true));
+        uint8_t * data = mappedFile->getData();
+        size_t size = mappedFile->getSize();
+        if (data != nullptr && size >= sizeof(Header))
+        {
+            Header * header = reinterpret_cast<Header *>(data);
+            size_t slotCount = header->slotCount;
+            if (
+                memcmp(
+                header->signature,
+                CacheFileSignature,
+                sizeof CacheFileSignature
+                ) == 0 &&
+                slotCount != 0 &&
+                (slotCount & (slotCount - 1)) == 0 &&
+                header->usedSlotCount < slotCount &&
+                (size - sizeof(Header)) / sizeof(Slot) == slotCount)
+            {
+                this->header = header;
+                slots = reinterpret_cast<Slot *>(data + sizeof(Header));
+                this->slotCount = slotCount;
+                return true;
+            }
+        }
+        mappedFile.reset();
+        return false;
+    }
+
+    void
+        MP3ResultCache::store(
+        const FileIdentity & identity,
+        uint32_t readSettings,
+        MP3AttributeSet attributeSet,
+        NonFramedDataFlags nonFramedDataFlags)
+    {
+        lock_guard<mutex> lock(slotMutex);
+        if (slots == nullptr) return;
+
+        Slot * slot =
+            findSlot(slots, slotCount, identity.device, identity.fileNumber);
+        if (
+            slot != nullptr &&
+            slot->checksum == 0 &&
+            (header->usedSlotCount + 1) * 4 > slotCount * 3)
+        {
+            grow();
+            if (slots == nullptr) return;
+            slot =
+                findSlot(
+                slots,
+                slotCount,
+                identity.device,
+                identity.fileNumber
+                );
+        }
+        if (slot == nullptr) return;
+        if (slot->checksum == 0) ++header->usedSlotCount;
+
+        slot->device = identity.device;
+        slot->fileNumber = identity.fileNumber;
+        slot->size = identity.size;
+        slot->modificationTime = identity.modificationTime;
+        slot->readSettings = readSettings;
+        slot->attributeSetData = attributeSet.data;
+        slot->nonFramedDataFlags = static_cast<uint32_t>(nonFramedDataFlags);
+        slot->checksum = calculateChecksum(slot, offsetof(Slot, checksum));
+    }
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include "MemoryMappedFile.h"
+#include "MP3GearWheel.h"
+#include "PathProcessor.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace MP3epoc
+{
+    // Keeps the attributes read from files in a hash table in a memory-mapped
+    // file, so that files that have not changed need not be read again. A
+    // result is only valid for the same file identity and the same read
+    // settings, a number chosen by the caller.
+    // All methods may be invoked concurrently. Several processes may use the
+    // cache file at the same time, but results may then be lost: entries
+    // damaged by concurrent writes are detected and discarded, and a process
+    // that grows the table replaces the file as a whole, so that the others
+    // keep their mapping of the old file until they open the cache again.
+    // Errors accessing the cache file are not reported: the cache simply
+    // behaves as if it were empty.
+    class MP3ResultCache
+    {
+    public:
+        explicit MP3ResultCache(const std::xstring & filePath);
+        MP3ResultCache(const MP3ResultCache &) = delete;
+        MP3ResultCache & operator = (const MP3ResultCache &) = delete;
+        const std::xstring & getFilePath() const;
+        bool load(
+            const FileIdentity & identity,
+            uint32_t readSettings,
+            MP3AttributeSet & attributeSet,
+            NonFramedDataFlags & nonFramedDataFlags
+            );
+        void store(
+            const FileIdentity & identity,
+            uint32_t readSettings,
+            MP3AttributeSet attributeSet,
+            NonFramedDataFlags nonFramedDataFlags
+            );
+        // Returns a file in the cache location of the current user, or an
+        // empty string if there is no such location.
+        static std::xstring getDefaultFilePath();
+    private:
+        struct Header;
+        struct Slot;
+        const std::xstring filePath;
+        std::mutex slotMutex;
+        std::unique_ptr<MemoryMappedFile> mappedFile;
+        Header * header;
+        Slot * slots;
+        size_t slotCount;
+        bool
+            create(
+            size_t slotCount,
+            const Slot * oldSlots,
+            size_t oldSlotCount
+            );
+        static Slot *
+            findSlot(
+            Slot * slots,
+            size_t slotCount,
+            uint64_t device,
+            uint64_t fileNumber
+            );
+        void grow();
+        static bool isValid(const Slot & slot);
+        bool open();
+    };
+}
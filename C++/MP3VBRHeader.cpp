@@ -0,0 +1,205 @@
+#include "MP3VBRHeader.h"
+
+#include <cstring>
+
+using namespace MP3epoc;
+using namespace std;
+
+namespace
+{
+    // Flags of the fields present in a Xing header.
+    const uint32_t XingFrameCountFlag   = 0x01;
+    const uint32_t XingByteCountFlag    = 0x02;
+    const uint32_t XingTOCFlag          = 0x04;
+
+    const size_t XingTOCSize = 100;
+
+    // A VBRI header is always found right after 32 bytes of side information.
+    const size_t VBRIOffset = 4 + 32;
+    const size_t VBRIFixedSize = 26;
+
+    size_t getXingOffset(const uint8_t frame[]);
+    bool
+        parseVBRI(
+        const uint8_t frame[],
+        size_t size,
+        MP3VBRHeader & vbrHeader
+        );
+    bool
+        parseXing(
+        const uint8_t frame[],
+        size_t size,
+        size_t offset,
+        MP3VBRHeader & vbrHeader
+        );
+    uint32_t readBigEndian(const uint8_t data[], size_t size);
+
+    // A Xing header follows the side information, whose size depends on the
+    // version and on the channel mode.
+    size_t getXingOffset(const uint8_t frame[])
+    {
+        bool isMPEG1 = (frame[1] & 0x18) == 0x18;
+        bool isMono = (frame[3] & 0xc0) == 0xc0;
+        size_t offset = 4;
+        if (!(frame[1] & 0x01)) offset += 2; // CRC
+        if (isMPEG1)
+            offset += isMono ? 17 : 32;
+        else
+            offset += isMono ? 9 : 17;
+        return offset;
+    }
+
+    bool
+        parseVBRI(
+        const uint8_t frame[],
+        size_t size,
+        MP3VBRHeader & vbrHeader)
+    {
+        const uint8_t * data = frame + VBRIOffset;
+        if (readBigEndian(data + 4, 2) != 1) return false; // version
+
+        vbrHeader.type = MP3VBRHeader::Type::VBRI;
+        vbrHeader.byteCount = readBigEndian(data + 10, 4);
+        vbrHeader.frameCount = readBigEndian(data + 14, 4);
+        vbrHeader.seekPoints.clear();
+
+        size_t entryCount = readBigEndian(data + 18, 2);
+        uint32_t scale = readBigEndian(data + 20, 2);
+        size_t entrySize = readBigEndian(data + 22, 2);
+        uint32_t framesPerEntry = readBigEndian(data + 24, 2);
+        if (
+            entrySize < 1 ||
+            entrySize > 4 ||
+            VBRIOffset + VBRIFixedSize + entryCount * entrySize > size)
+            return false;
+
+        // Every entry holds the size of the next framesPerEntry frames,
+        // counting from the end of the header frame.
+        if (vbrHeader.frameCount != 0 && vbrHeader.byteCount != 0)
+        {
+            const uint8_t * entry = data + VBRIFixedSize;
+            uint64_t offset = size;
+            uint64_t frameCount = 0;
+            vbrHeader.seekPoints.reserve(entryCount);
+            for (size_t index = 0; index < entryCount; ++index)
+            {
+                uint64_t entryValue = readBigEndian(entry, entrySize);
+                offset += entryValue * scale;
+                frameCount += framesPerEntry;
+                if (
+                    frameCount >= vbrHeader.frameCount ||
+                    offset >= vbrHeader.byteCount)
+                    break;
+                MP3VBRHeader::SeekPoint seekPoint =
+                {
+                    static_cast<uint32_t>(frameCount),
+                    static_cast<uint32_t>(offset)
+                };
+                vbrHeader.seekPoints.push_back(seekPoint);
+                entry += entrySize;
+            }
+        }
+        return true;
+    }
+
+    bool
+        parseXing(
+        const uint8_t frame[],
+        size_t size,
+        size_t offset,
+        MP3VBRHeader & vbrHeader)
+    {
+        const uint8_t * data = frame + offset;
+        vbrHeader.type =
+            data[0] == 'X' ?
+            MP3VBRHeader::Type::Xing :
+            MP3VBRHeader::Type::Info;
+        uint32_t flags = readBigEndian(data + 4, 4);
+        size_t position = 8;
+
+        vbrHeader.frameCount = 0;
+        if (flags & XingFrameCountFlag)
+        {
+            if (offset + position + 4 > size) return false;
+            vbrHeader.frameCount = readBigEndian(data + position, 4);
+            position += 4;
+        }
+        vbrHeader.byteCount = 0;
+        if (flags & XingByteCountFlag)
+        {
+            if (offset + position + 4 > size) return false;
+            vbrHeader.byteCount = readBigEndian(data + position, 4);
+            position += 4;
+        }
+
+        // Entry i of the table of contents holds the offset of the frame at i
+        // percent of the playing time, in 256ths of the byte count. As every
+        // frame has the same duration, this is also i percent of the frames.
+        vbrHeader.seekPoints.clear();
+        if (flags & XingTOCFlag)
+        {
+            if (offset + position + XingTOCSize > size) return false;
+            if (vbrHeader.frameCount != 0 && vbrHeader.byteCount != 0)
+            {
+                vbrHeader.seekPoints.resize(XingTOCSize);
+                for (size_t index = 0; index < XingTOCSize; ++index)
+                {
+                    MP3VBRHeader::SeekPoint & seekPoint =
+                        vbrHeader.seekPoints[index];
+                    seekPoint.frameCount =
+                        static_cast<uint32_t>(
+                        static_cast<uint64_t>(vbrHeader.frameCount) * index /
+                        XingTOCSize
+                        );
+                    seekPoint.offset =
+                        static_cast<uint32_t>(
+                        static_cast<uint64_t>(vbrHeader.byteCount) *
+                        data[position + index] / 256
+                        );
+                }
+            }
+        }
+        return true;
+    }
+
+    uint32_t readBigEndian(const uint8_t data[], size_t size)
+    {
+        uint32_t value = 0;
+        for (size_t index = 0; index < size; ++index)
+            value = value << 8 | data[index];
+        return value;
+    }
+}
+
+namespace MP3epoc
+{
+    bool
+        MP3VBRHeader::parse(
+        const uint8_t frame[],
+        size_t size,
+        MP3VBRHeader & vbrHeader)
+    {
+        // Only Layer III frames hold VBR headers.
+        if (size < 4 || (frame[1] & 0x06) != 0x02) return false;
+
+        MP3VBRHeader newHeader;
+        size_t offset = getXingOffset(frame);
+        if (
+            offset + 8 <= size &&
+            (memcmp(frame + offset, "Xing", 4) == 0 ||
+            memcmp(frame + offset, "Info", 4) == 0))
+        {
+            if (!parseXing(frame, size, offset, newHeader)) return false;
+        }
+        else if (
+            VBRIOffset + VBRIFixedSize <= size &&
+            memcmp(frame + VBRIOffset, "VBRI", 4) == 0)
+        {
+            if (!parseVBRI(frame, size, newHeader)) return false;
+        }
+        else
+            return false;
+        vbrHeader = newHeader;
+        return true;
+    }
+}
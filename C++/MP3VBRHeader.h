@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace MP3epoc
+{
+    // The header that encoders store in place of audio data in the first
+    // frame of a file: a Xing header (Info for files with a constant bitrate)
+    // as written by the Xing and LAME encoders, or a VBRI header as written by
+    // the Fraunhofer encoder.
+    struct MP3VBRHeader
+    {
+        enum class Type
+        {
+            Xing,
+            Info,
+            VBRI,
+        };
+
+        // An estimate of the position of a frame, taken from the table of
+        // contents of the header.
+        struct SeekPoint
+        {
+            // The number of frames between the header frame and the frame.
+            uint32_t frameCount;
+            // The distance of the frame from the start of the header frame,
+            // in bytes.
+            uint32_t offset;
+        };
+
+        Type type;
+        // The number of frames after the header frame, or 0 if not stored.
+        uint32_t frameCount;
+        // The number of bytes of the frames, including the header frame, or 0
+        // if not stored.
+        uint32_t byteCount;
+        // Ordered by frame count. Empty if the header has no table of contents
+        // or if the counts it refers to are not stored.
+        std::vector<SeekPoint> seekPoints;
+
+        // Parses the header in the specified frame, including its frame
+        // header. Returns false, leaving vbrHeader unchanged, if the frame
+        // holds no valid header.
+        static bool
+            parse(const uint8_t frame[], size_t size, MP3VBRHeader & vbrHeader);
+    };
+}
@@ -1,16 +1,25 @@
 ﻿#include "findAllFilePaths.h"
 #include "getStdOutBufferWidth.h"
+#include "MP3FrameIndexCache.h"
+#include "MP3ResultCache.h"
 #include "processFile.h"
 #include "setUpOutputEncoding.h"
 #include "shrinkTextWidth.h"
 #include "toUpperASCII.h"
 #include "version.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <thread>
 
 #ifdef _WIN32
 
+#include <cstdio>
+#include <fcntl.h>
+#include <io.h>
+
 #define OPTION_PREFIX '/'
 
 #else
@@ -24,8 +33,12 @@ using namespace std;
 
 namespace
 {
+    const unsigned int MaxThreadCount = 256;
+
     int getConsoleBufferWidth();
-    void subMain(int argc, xchar * argv[]);
+    unsigned int getProcessorCount();
+    void setUpBinaryStdIO(bool binaryOutput);
+    int subMain(int argc, xchar * argv[]);
     void writeError(const xstring & error);
     void writeHelp();
     void
@@ -40,19 +53,49 @@ namespace
         return getStdOutBufferWidth();
     }
 
-    void subMain(int argc, xchar * argv[])
+    unsigned int getProcessorCount()
+    {
+        unsigned int count = thread::hardware_concurrency();
+        return min(max(count, 1U), MaxThreadCount);
+    }
+
+#if defined(_WIN32)
+
+    // The data of a file read from the standard input stream, and written to
+    // the standard output stream, must not be translated.
+    void setUpBinaryStdIO(bool binaryOutput)
+    {
+        _setmode(_fileno(stdin), _O_BINARY);
+        if (binaryOutput) _setmode(_fileno(stdout), _O_BINARY);
+    }
+
+#else // #if defined(_WIN32)
+
+    void setUpBinaryStdIO(bool)
+    { }
+
+#endif // #if defined(_WIN32)
+
+    int subMain(int argc, xchar * argv[])
     {
         setUpOutputEncoding();
 
         MP3AttributeSet attributeSet;
         xchar formatSpec = XSTR('\0');
         bool optionF = false;
+        bool optionI = false;
+        bool optionK = false;
+        bool optionQ = false;
+        bool optionR = false;
+        bool optionU = false;
+        bool optionV = false;
+        unsigned int threadCount = 0;
 
         xstring error;
 
         RESID errorId;
 
-        vector<const xstring> paths;
+        vector<xstring> paths;
 
         auto
             parseAttrSpec =
@@ -101,12 +144,49 @@ namespace
 
         auto
             parseOpt =
-            [&attributeSet, &errorId, &formatSpec, &optionF, argc]
+            [
+                &attributeSet,
+                &errorId,
+                &formatSpec,
+                &optionF,
+                &optionI,
+                &optionK,
+                &optionQ,
+                &optionR,
+                &optionU,
+                &optionV,
+                &threadCount,
+                argc
+            ]
             (const xstring & arg, RESID badOptionErrorId)
             {
                 auto argLen = arg.length();
                 xchar secondChar = toUpperASCII(arg[1]);
-                if (secondChar == XSTR('E'))
+                if (secondChar == XSTR('J'))
+                {
+                    // Without a number, use one thread per processor.
+                    unsigned int count = 0;
+                    if (argLen == 2)
+                        count = getProcessorCount();
+                    else
+                    {
+                        for (unsigned int index = 2; index < argLen; ++index)
+                        {
+                            xchar digit = arg[index];
+                            if (digit < XSTR('0') || digit > XSTR('9'))
+                                goto bad_option;
+                            count = count * 10 + (digit - XSTR('0'));
+                            if (count > MaxThreadCount) goto bad_option;
+                        }
+                        if (count == 0) goto bad_option;
+                    }
+                    if (threadCount == 0)
+                    {
+                        threadCount = count;
+                        return 1;
+                    }
+                }
+                else if (secondChar == XSTR('E'))
                 {
                     if (argLen != 3) goto bad_option;
 
@@ -144,6 +224,8 @@ namespace
                     {
                     case XSTR('L'):
                     case XSTR('S'):
+                    case XSTR('N'):
+                    case XSTR('T'):
                         if (formatSpec != XSTR('\0')) break;
                         formatSpec = secondChar;
                         return 1;
@@ -155,6 +237,30 @@ namespace
                         if (optionF) break;
                         optionF = true;
                         return 1;
+                    case XSTR('I'):
+                        if (optionI) break;
+                        optionI = true;
+                        return 1;
+                    case XSTR('K'):
+                        if (optionK) break;
+                        optionK = true;
+                        return 1;
+                    case XSTR('Q'):
+                        if (optionQ) break;
+                        optionQ = true;
+                        return 1;
+                    case XSTR('R'):
+                        if (optionR) break;
+                        optionR = true;
+                        return 1;
+                    case XSTR('U'):
+                        if (optionU) break;
+                        optionU = true;
+                        return 1;
+                    case XSTR('V'):
+                        if (optionV) break;
+                        optionV = true;
+                        return 1;
                     case XSTR('?'):
                         if (argc != 1) break;
                         writeHelp();
@@ -226,14 +332,14 @@ namespace
                         if (result > 0) continue;
                         if (result < 0) goto error_id;
                     }
-                    return;
+                    return 0;
                 case XSTR(OPTION_PREFIX):
                     {
                         int result = parseOpt(arg, MSG_BAD_OPTION);
                         if (result > 0) continue;
                         if (result < 0) goto error_id;
                     }
-                    return;
+                    return 0;
                 default:
                     // Must parse arg as a file name.
                     break;
@@ -254,7 +360,8 @@ namespace
             bool anyReadingOption =
                 formatSpec != XSTR('\0') ||
                 attributeSet.isWholeFile() ||
-                optionF;
+                optionF ||
+                optionV;
 
             if (
                 !anyReadingOption &&
@@ -265,17 +372,51 @@ namespace
                 goto error_id;
             }
 
-            vector<const xstring> filePaths;
-            int findFilePathsResult =
-                findAllFilePaths(writeError, paths, filePaths);
-            if (findFilePathsResult < 0) return;
+            // The path - stands for the standard input stream, and it must be
+            // the only path.
+            bool stdIOUsed =
+                find(paths.cbegin(), paths.cend(), XSTR("-")) != paths.cend();
+            if (stdIOUsed && paths.size() != 1)
+            {
+                errorId = MSG_SYNTAX_ERROR;
+                goto error_id;
+            }
+
+            // Directories are walked with one thread per processor unless
+            // a number of threads is specified.
+            unsigned int walkThreadCount =
+                threadCount != 0 ? threadCount : getProcessorCount();
+
+            // With /K, all files are found before the first one is processed,
+            // so that nothing is processed if any path is invalid, and the
+            // files are listed in order. Otherwise, the files are processed
+            // while the search is still going on. Since no file may be changed
+            // if any path is invalid, attributes are always applied as with
+            // /K.
+            bool applying =
+                !anyReadingOption && !attributeSet.isUnspecified();
+            bool searchingFirst = optionK || applying;
+            vector<xstring> filePaths;
+            int findFilePathsResult = 0;
+            if (searchingFirst && !stdIOUsed)
+            {
+                findFilePathsResult =
+                    findAllFilePaths(
+                    writeError,
+                    paths,
+                    optionR,
+                    walkThreadCount,
+                    filePaths
+                    );
+                if (findFilePathsResult < 0) return 0;
+            }
 
             {
                 // Process files.
 
                 MP3AttributeSet attributeSetToApply;
 
-                if (anyReadingOption || attributeSet.isUnspecified())
+                if (!applying)
                 {
                     attributeSetToApply = attributeSet.getUnspecified();
                     // If neither of the options /L or /S and no attribute
@@ -293,32 +434,111 @@ namespace
 
                 int processedFileCount = 0;
                 int modifiedFileCount = 0;
+                int listedFileCount = 0;
 
                 MP3GearWheel gearWheel(attributeSetToApply);
                 if (!optionF) gearWheel.setKeyFrameNumber(2);
+                // Without a cache location of the current user, /I and /U
+                // have no effect.
+                xstring indexDirPath =
+                    optionI ?
+                    MP3FrameIndexCache::getDefaultDirPath() :
+                    xstring();
+                if (!indexDirPath.empty())
+                {
+                    gearWheel.setFrameIndexCache(
+                        make_shared<MP3FrameIndexCache>(indexDirPath)
+                        );
+                }
+                // With /N or /T, a file is not read any further once it is
+                // known not to match. So it is with /Q, unless the attributes
+                // of the files that do not match are shown.
+                bool pathsOnly =
+                    formatSpec == XSTR('N') || formatSpec == XSTR('T');
+                if (optionQ || pathsOnly)
+                {
+                    gearWheel.setEarlyExit(true);
+                    if (pathsOnly || !optionV)
+                        gearWheel.setAttributeSetToMatch(attributeSet);
+                }
+                xstring resultFilePath =
+                    optionU ? MP3ResultCache::getDefaultFilePath() : xstring();
+                if (!resultFilePath.empty())
+                {
+                    gearWheel.setResultCache(
+                        make_shared<MP3ResultCache>(resultFilePath)
+                        );
+                }
 
-                for (const xstring & filePath: filePaths)
+                // Processing the standard input stream is the only way to tell
+                // the caller about failure.
+                if (stdIOUsed)
                 {
+                    setUpBinaryStdIO(!attributeSetToApply.isUnspecified());
                     ProcessFileResult processFileResult =
-                        processFile(
-                        filePath,
+                        processStdIO(
                         gearWheel,
                         attributeSet,
+                        optionV,
                         formatSpec
                         );
-                    switch (processFileResult)
+                    if (formatSpec == XSTR('T'))
                     {
-                    case ProcessFileResult::Modified:
-                        ++modifiedFileCount;
-                        // fall through
-                    case ProcessFileResult::Unmodified:
-                        ++processedFileCount;
-                        break;
-                    case ProcessFileResult::Unprocessed:
-                        break;
+                        xcout <<
+                            (processFileResult == ProcessFileResult::Listed ?
+                            1 : 0) << endl;
                     }
+                    return
+                        processFileResult == ProcessFileResult::Unprocessed ?
+                        1 : 0;
+                }
+
+                if (searchingFirst)
+                {
+                    processFiles(
+                        filePaths,
+                        gearWheel,
+                        attributeSet,
+                        optionV,
+                        formatSpec,
+                        threadCount,
+                        processedFileCount,
+                        modifiedFileCount,
+                        listedFileCount
+                        );
+                }
+                else
+                {
+                    processFiles(
+                        [&] (function<void (xstring &&)> addFilePath)
+                        {
+                            findFilePathsResult =
+                                findAllFilePaths(
+                                writeError,
+                                paths,
+                                optionR,
+                                walkThreadCount,
+                                false,
+                                addFilePath
+                                );
+                        },
+                        gearWheel,
+                        attributeSet,
+                        optionV,
+                        formatSpec,
+                        threadCount,
+                        processedFileCount,
+                        modifiedFileCount,
+                        listedFileCount
+                        );
+
+                    // As with /K, no summary is written if any path is
+                    // invalid.
+                    if (findFilePathsResult < 0) return 0;
                 }
 
+                if (formatSpec == XSTR('T'))
+                    xcout << listedFileCount << endl;
                 if (!attributeSetToApply.isUnspecified())
                     writeSummary(
                         findFilePathsResult > 0,
@@ -328,13 +548,14 @@ namespace
             }
         }
 
-        return;
+        return 0;
 
     error_id:
         error = getResourceString(errorId);
 
     error:
         writeError(error);
+        return 0;
     }
     
     void writeError(const xstring & error)
@@ -426,6 +647,5 @@ namespace
 
 int xmain(int argc, xchar * argv[])
 {
-    subMain(argc - 1, argv + 1);
-    return 0;
+    return subMain(argc - 1, argv + 1);
 }
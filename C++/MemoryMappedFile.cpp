@@ -0,0 +1,134 @@
+#include "MemoryMappedFile.h"
+
+#if defined(_WIN32)
+
+#include "Finally.h"
+#include "Windows API.h"
+
+using namespace std;
+
+MemoryMappedFile::MemoryMappedFile(const xstring & path, bool writable):
+    data(nullptr), size(0)
+{
+    HANDLE hFile =
+        CreateFileW(
+        path.c_str(),
+        writable ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ,
+        FILE_SHARE_READ | FILE_SHARE_WRITE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL
+        );
+    if (hFile == INVALID_HANDLE_VALUE) return;
+    Finally finFile(
+        [hFile]
+        {
+            CloseHandle(hFile);
+        }
+        );
+
+    LARGE_INTEGER fileSize;
+    if (
+        !GetFileSizeEx(hFile, &fileSize) ||
+        fileSize.QuadPart == 0 ||
+        static_cast<ULONGLONG>(fileSize.QuadPart) > SIZE_MAX)
+        return;
+
+    // The view keeps a reference to the mapping object, so both handles can be
+    // closed as soon as the view has been created.
+    HANDLE hMapping =
+        CreateFileMappingW(
+        hFile,
+        NULL,
+        writable ? PAGE_READWRITE : PAGE_READONLY,
+        0,
+        0,
+        NULL
+        );
+    if (hMapping == NULL) return;
+    Finally finMapping(
+        [hMapping]
+        {
+            CloseHandle(hMapping);
+        }
+        );
+
+    void * view =
+        MapViewOfFile(
+        hMapping,
+        writable ? FILE_MAP_WRITE : FILE_MAP_READ,
+        0,
+        0,
+        0
+        );
+    if (view == NULL) return;
+    data = static_cast<uint8_t *>(view);
+    size = static_cast<size_t>(fileSize.QuadPart);
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    if (data != nullptr) UnmapViewOfFile(data);
+}
+
+#else // #if defined(_WIN32)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+MemoryMappedFile::MemoryMappedFile(const xstring & path, bool writable):
+    data(nullptr), size(0)
+{
+    int fd = open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return;
+
+    // The mapping keeps a reference to the file, so the descriptor can be
+    // closed as soon as the mapping has been created.
+    struct stat st;
+    if (
+        fstat(fd, &st) == 0 &&
+        S_ISREG(st.st_mode) &&
+        st.st_size > 0 &&
+        static_cast<uintmax_t>(st.st_size) <= SIZE_MAX)
+    {
+        size_t fileSize = static_cast<size_t>(st.st_size);
+        void * addr =
+            mmap(
+            nullptr,
+            fileSize,
+            writable ? PROT_READ | PROT_WRITE : PROT_READ,
+            MAP_SHARED,
+            fd,
+            0
+            );
+        if (addr != MAP_FAILED)
+        {
+            posix_madvise(addr, fileSize, POSIX_MADV_SEQUENTIAL);
+            data = static_cast<uint8_t *>(addr);
+            size = fileSize;
+        }
+    }
+    close(fd);
+}
+
+MemoryMappedFile::~MemoryMappedFile()
+{
+    if (data != nullptr) munmap(data, size);
+}
+
+#endif // #if defined(_WIN32)
+
+uint8_t * MemoryMappedFile::getData() const
+{
+    return data;
+}
+
+size_t MemoryMappedFile::getSize() const
+{
+    return size;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "xsys.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Maps a whole file into memory. If the file cannot be mapped (e.g. because it
+// is empty or it resides on a file system that does not support mapping), no
+// exception is thrown, and getData returns a null pointer.
+
+class MemoryMappedFile
+{
+public:
+    MemoryMappedFile(const std::xstring & path, bool writable);
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    ~MemoryMappedFile();
+    MemoryMappedFile & operator = (const MemoryMappedFile &) = delete;
+    uint8_t * getData() const;
+    size_t getSize() const;
+private:
+    uint8_t * data;
+    size_t size;
+};
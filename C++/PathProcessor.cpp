@@ -1,16 +1,21 @@
 #include "Finally.h"
 #include "PathProcessor.h"
 
+#include <atomic>
+#include <sstream>
+
 #if defined(_WIN32)
 
 #include "Windows API.h"
 
 #include <algorithm>
+#include <ShlObj.h>
 
 using namespace std;
 
 namespace
 {
+    wstring appendPathComponent(const wstring & dirPath, const wchar_t * name);
     bool exists(const wchar_t * filePath);
     string getSystemErrorMessage(DWORD error);
     wstring
@@ -19,8 +24,22 @@ namespace
         const wchar_t * dirNameEnd,
         const wchar_t * fileName
         );
+    unsigned long getProcessId();
     DECLSPEC_NORETURN void throwFailure(DWORD error);
 
+    wstring appendPathComponent(const wstring & dirPath, const wchar_t * name)
+    {
+        wstring path(dirPath);
+        if (!path.empty())
+        {
+            wchar_t lastChar = path.back();
+            if (lastChar != L'\\' && lastChar != L'/' && lastChar != L':')
+                path += L'\\';
+        }
+        path += name;
+        return path;
+    }
+
     bool exists(const wchar_t * filePath)
     {
         HANDLE hFile =
@@ -63,6 +82,11 @@ namespace
         return message;
     }
 
+    unsigned long getProcessId()
+    {
+        return GetCurrentProcessId();
+    }
+
     wstring
         joinFilePath(
         const wchar_t * dirNameBegin,
@@ -110,6 +134,19 @@ namespace
     }
 }
 
+void createDirectories(const xchar * dirPath)
+{
+    wstring path(dirPath);
+    for (
+        size_t index = path.find_first_of(L"\\/", 1);
+        ;
+        index = path.find_first_of(L"\\/", index + 1))
+    {
+        CreateDirectoryW(path.substr(0, index).c_str(), NULL);
+        if (index == wstring::npos) break;
+    }
+}
+
 vector<xstring> findFilePaths(const xchar * path, bool & wildcardsUsed)
 {
     vector<wstring> filePaths;
@@ -159,6 +196,52 @@ vector<xstring> findFilePaths(const xchar * path, bool & wildcardsUsed)
     return filePaths;
 }
 
+xstring getCacheDirPath()
+{
+    wchar_t path[MAX_PATH];
+    if (
+        SUCCEEDED(SHGetFolderPathW(NULL, CSIDL_LOCAL_APPDATA, NULL, 0, path)))
+        return appendPathComponent(path, L"MP3epoc");
+    GetTempPathW(MAX_PATH, path);
+    return appendPathComponent(path, L"MP3epoc");
+}
+
+bool getFileIdentity(const xchar * path, FileIdentity & identity)
+{
+    HANDLE hFile =
+        CreateFileW(
+        path,
+        FILE_READ_ATTRIBUTES,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        0,
+        NULL
+        );
+    if (hFile == INVALID_HANDLE_VALUE) return false;
+    Finally finFile(
+        [hFile]
+        {
+            CloseHandle(hFile);
+        }
+        );
+
+    BY_HANDLE_FILE_INFORMATION info;
+    if (
+        !GetFileInformationByHandle(hFile, &info) ||
+        info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        return false;
+    identity.device = info.dwVolumeSerialNumber;
+    identity.fileNumber =
+        static_cast<uint64_t>(info.nFileIndexHigh) << 32 | info.nFileIndexLow;
+    identity.size =
+        static_cast<uint64_t>(info.nFileSizeHigh) << 32 | info.nFileSizeLow;
+    identity.modificationTime =
+        static_cast<uint64_t>(info.ftLastWriteTime.dwHighDateTime) << 32 |
+        info.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
 const xchar * getFileName(const xchar * path)
 {
     const wchar_t * fileName = path;
@@ -185,15 +268,182 @@ bool isDirectory(const xchar * path)
         attributes & FILE_ATTRIBUTE_DIRECTORY;
 }
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+void
+    listDirectory(
+    const xstring & dirPath,
+    const xchar * pattern,
+    vector<xstring> & filePaths,
+    vector<xstring> & subdirPaths)
+{
+    // The subdirectories are searched separately, because their names need not
+    // match the pattern. Files are searched with the pattern, so that the names
+    // match by the same rules as in findFilePaths.
+    for (int search = 0; search < 2; ++search)
+    {
+        bool searchFiles = search != 0;
+        wstring searchPath =
+            appendPathComponent(dirPath, searchFiles ? pattern : L"*");
+        DWORD error;
+        {
+            WIN32_FIND_DATAW findFileData;
+            HANDLE hFindFile =
+                FindFirstFileExW(
+                searchPath.c_str(),
+                FindExInfoBasic,
+                &findFileData,
+                searchFiles ?
+                FindExSearchNameMatch :
+                FindExSearchLimitToDirectories,
+                NULL,
+                FIND_FIRST_EX_LARGE_FETCH
+                );
+            Finally fin(
+                [&hFindFile]
+                {
+                    if (hFindFile != INVALID_HANDLE_VALUE) FindClose(hFindFile);
+                }
+                );
+            if (hFindFile == INVALID_HANDLE_VALUE)
+            {
+                DWORD error = GetLastError();
+                if (error == ERROR_FILE_NOT_FOUND) continue;
+                throwFailure(error);
+            }
+            do
+            {
+                DWORD attributes = findFileData.dwFileAttributes;
+                const wchar_t * fileName = findFileData.cFileName;
+                if (!(attributes & FILE_ATTRIBUTE_DIRECTORY))
+                {
+                    if (searchFiles)
+                        filePaths.push_back(
+                            appendPathComponent(dirPath, fileName)
+                            );
+                }
+                // Junctions and directory links are not followed, since they
+                // could lead into a cycle.
+                else if (
+                    !searchFiles &&
+                    !(attributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+                    wcscmp(fileName, L".") != 0 &&
+                    wcscmp(fileName, L"..") != 0)
+                {
+                    subdirPaths.push_back(
+                        appendPathComponent(dirPath, fileName)
+                        );
+                }
+            }
+            while (FindNextFileW(hFindFile, &findFileData));
+            error = GetLastError();
+        }
+        if (error != ERROR_NO_MORE_FILES) throwFailure(error);
+    }
+}
+
+void removeFile(const xchar * filePath)
+{
+    DeleteFileW(filePath);
+}
 
-#include <glob.h>
-#include <ios>
+bool replaceFile(const xchar * srcPath, const xchar * destPath)
+{
+    return MoveFileExW(srcPath, destPath, MOVEFILE_REPLACE_EXISTING) != FALSE;
+}
+
+#else // #if defined(_WIN32)
+
+#include <cstdio>
 #include <sys/stat.h>
 #include <unistd.h>
 
 using namespace std;
 
+// The helpers shared by the macOS and Linux implementations.
+namespace
+{
+    string appendPathComponent(const string & dirPath, const char * name);
+    string getPrivateTempDirPath(const char * name);
+    unsigned long getProcessId();
+
+    string appendPathComponent(const string & dirPath, const char * name)
+    {
+        string path(dirPath);
+        if (!path.empty() && path.back() != '/') path += '/';
+        path += name;
+        return path;
+    }
+
+    // Returns the path of the directory /tmp/<name>-<user id>, which is
+    // created if it does not exist. Since anyone may create files in /tmp,
+    // an empty string is returned unless it is a directory, not a link, that
+    // only the current user can access.
+    string getPrivateTempDirPath(const char * name)
+    {
+        uid_t userId = getuid();
+        string dirPath =
+            string("/tmp/").append(name).append(1, '-')
+            .append(to_string(userId));
+        mkdir(dirPath.c_str(), 0700);
+        struct stat st;
+        if (
+            lstat(dirPath.c_str(), &st) != 0 ||
+            !S_ISDIR(st.st_mode) ||
+            st.st_uid != userId ||
+            (st.st_mode & (S_IRWXG | S_IRWXO)) != 0)
+            return string();
+        return dirPath;
+    }
+
+    unsigned long getProcessId()
+    {
+        return static_cast<unsigned long>(getpid());
+    }
+}
+
+void removeFile(const xchar * filePath)
+{
+    unlink(filePath);
+}
+
+bool replaceFile(const xchar * srcPath, const xchar * destPath)
+{
+    return rename(srcPath, destPath) == 0;
+}
+
+#endif // #if defined(_WIN32)
+
+#if defined(__APPLE__)
+
+#include <cstdlib>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <glob.h>
+#include <ios>
+
+namespace
+{
+    void throwFailure(int error);
+
+    void throwFailure(int error)
+    {
+        throw
+            ios_base::failure(
+            strerror(error),
+            make_error_code(static_cast<errc>(error))
+            );
+    }
+}
+
+void createDirectories(const xchar * dirPath)
+{
+    string path(dirPath);
+    for (size_t index = path.find('/', 1);; index = path.find('/', index + 1))
+    {
+        mkdir(path.substr(0, index).c_str(), 0777);
+        if (index == string::npos) break;
+    }
+}
+
 vector<xstring> findFilePaths(const xchar * path, bool & wildcardsUsed)
 {
     vector<xstring> filePaths;
@@ -251,6 +501,27 @@ vector<xstring> findFilePaths(const xchar * path, bool & wildcardsUsed)
     return filePaths;
 }
 
+xstring getCacheDirPath()
+{
+    const char * homeDirPath = getenv("HOME");
+    if (homeDirPath == nullptr || homeDirPath[0] == '\0')
+        return getPrivateTempDirPath("MP3epoc");
+    return appendPathComponent(homeDirPath, "Library/Caches/MP3epoc");
+}
+
+bool getFileIdentity(const xchar * path, FileIdentity & identity)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    identity.device = static_cast<uint64_t>(st.st_dev);
+    identity.fileNumber = static_cast<uint64_t>(st.st_ino);
+    identity.size = static_cast<uint64_t>(st.st_size);
+    identity.modificationTime =
+        static_cast<uint64_t>(st.st_mtimespec.tv_sec) * 1000000000 +
+        static_cast<uint64_t>(st.st_mtimespec.tv_nsec);
+    return true;
+}
+
 const xchar * getFileName(const xchar * path)
 {
     const char * fileName = path;
@@ -270,4 +541,446 @@ bool isDirectory(const xchar * path)
     return !stat(path, &st) && st.st_mode & S_IFDIR;
 }
 
-#endif // #if defined(_WIN32)
+void
+    listDirectory(
+    const xstring & dirPath,
+    const xchar * pattern,
+    vector<xstring> & filePaths,
+    vector<xstring> & subdirPaths)
+{
+    DIR * dir = opendir(dirPath.empty() ? "." : dirPath.c_str());
+    if (dir == NULL) throwFailure(errno);
+    Finally fin(
+        [dir]
+        {
+            closedir(dir);
+        }
+        );
+    for (;;)
+    {
+        errno = 0;
+        const dirent * entry = readdir(dir);
+        if (entry == NULL)
+        {
+            if (errno != 0) throwFailure(errno);
+            break;
+        }
+
+        const char * name = entry->d_name;
+        if (
+            name[0] == '.' &&
+            (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+        // Links to directories are not followed, since they could lead into a
+        // cycle, while links to regular files are.
+        struct stat st;
+        int type = entry->d_type;
+        if (type == DT_UNKNOWN)
+        {
+            string path = appendPathComponent(dirPath, name);
+            if (lstat(path.c_str(), &st) != 0) continue;
+            type = IFTODT(st.st_mode);
+        }
+        if (type == DT_DIR)
+            subdirPaths.push_back(appendPathComponent(dirPath, name));
+        else if (
+            (type == DT_REG || type == DT_LNK) &&
+            fnmatch(pattern, name, FNM_NOESCAPE | FNM_PERIOD) == 0)
+        {
+            string path = appendPathComponent(dirPath, name);
+            if (
+                type == DT_REG ||
+                (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)))
+                filePaths.push_back(move(path));
+        }
+    }
+}
+
+#elif defined(__linux__) // #if defined(__APPLE__)
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <functional>
+#include <ios>
+#include <memory>
+#include <pwd.h>
+#include <sys/syscall.h>
+
+// Patterns are expanded like glob with the flags GLOB_ERR, GLOB_NOESCAPE and
+// GLOB_TILDE, but one path component at a time, relative to the descriptor of
+// the directory matched so far. Directories are enumerated with getdents64,
+// and the file type is taken from the directory entry, so that only symbolic
+// links and entries of unknown type need to be inspected with fstatat.
+namespace
+{
+    const size_t DirectoryBufferSize = 0x10000;
+
+    void
+        expandPattern(
+        int dirFd,
+        const string & dirPath,
+        const char * pattern,
+        vector<string> & filePaths
+        );
+    string expandTilde(const char * path);
+    const char * findWildcards(const char * pattern);
+    bool hasWildcards(const char * begin, const char * end);
+    bool isRegularFile(int dirFd, const char * name, unsigned char type);
+    void readDirectory(int fd, function<void (const dirent64 &)> processEntry);
+    void throwFailure(int error, errc internalErrc);
+
+    // Adds to filePaths the regular files matching pattern, which is relative
+    // to the directory dirFd refers to. dirPath is prepended to the names of
+    // the files found: it is either empty or the path of that directory with
+    // a trailing directory separator.
+    void
+        expandPattern(
+        int dirFd,
+        const string & dirPath,
+        const char * pattern,
+        vector<string> & filePaths)
+    {
+        // Components without wildcards are not enumerated, but passed on to
+        // openat or fstatat as a whole.
+        const char * component = findWildcards(pattern);
+        if (component == nullptr)
+        {
+            if (isRegularFile(dirFd, pattern, DT_UNKNOWN))
+                filePaths.push_back(string(dirPath).append(pattern));
+            return;
+        }
+
+        string literalPath(pattern, component);
+        const char * componentEnd = strchrnul(component, '/');
+        string componentPattern(component, componentEnd);
+        const char * nextPattern = componentEnd;
+        while (*nextPattern == '/') ++nextPattern;
+        bool isLast = componentEnd == nextPattern;
+
+        int fd =
+            openat(
+            dirFd,
+            literalPath.empty() ? "." : literalPath.c_str(),
+            O_RDONLY | O_DIRECTORY | O_CLOEXEC
+            );
+        if (fd < 0)
+        {
+            int error = errno;
+            if (error == ENOTDIR) return;
+            throwFailure(error, errc::io_error);
+        }
+        Finally fin(
+            [fd]
+            {
+                close(fd);
+            }
+            );
+
+        // A pattern with a trailing directory separator is only matched by
+        // directories.
+        if (!isLast && *nextPattern == '\0') return;
+
+        string path = string(dirPath).append(literalPath);
+        readDirectory(
+            fd,
+            [&] (const dirent64 & entry)
+            {
+                const char * name = entry.d_name;
+                if (
+                    fnmatch(
+                    componentPattern.c_str(),
+                    name,
+                    FNM_NOESCAPE | FNM_PERIOD) != 0)
+                    return;
+
+                unsigned char type = entry.d_type;
+                if (isLast)
+                {
+                    if (isRegularFile(fd, name, type))
+                        filePaths.push_back(string(path).append(name));
+                }
+                else if (
+                    type == DT_DIR || type == DT_LNK || type == DT_UNKNOWN)
+                {
+                    string subdirPath =
+                        string(path)
+                        .append(name)
+                        .append(componentEnd, nextPattern);
+                    int subdirFd =
+                        openat(fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (subdirFd < 0)
+                    {
+                        // Like glob, only fail if a directory to be enumerated
+                        // cannot be read, and skip anything else that is not a
+                        // directory, like dangling links.
+                        int error = errno;
+                        if (
+                            error == ENOENT ||
+                            error == ENOTDIR ||
+                            error == ELOOP ||
+                            !findWildcards(nextPattern))
+                            return;
+                        throwFailure(error, errc::io_error);
+                    }
+                    Finally fin(
+                        [subdirFd]
+                        {
+                            close(subdirFd);
+                        }
+                        );
+                    expandPattern(subdirFd, subdirPath, nextPattern, filePaths);
+                }
+            }
+            );
+    }
+
+    // Replaces a leading "~" or "~user" with the home directory of the current
+    // or the specified user. Unknown users are left unexpanded.
+    string expandTilde(const char * path)
+    {
+        if (path[0] != '~') return path;
+
+        const char * nameEnd = strchrnul(path, '/');
+        const char * homeDir = nullptr;
+        if (nameEnd == path + 1)
+        {
+            homeDir = getenv("HOME");
+            if (homeDir == nullptr)
+            {
+                const passwd * pw = getpwuid(getuid());
+                if (pw != nullptr) homeDir = pw->pw_dir;
+            }
+        }
+        else
+        {
+            string userName(path + 1, nameEnd);
+            const passwd * pw = getpwnam(userName.c_str());
+            if (pw != nullptr) homeDir = pw->pw_dir;
+        }
+        if (homeDir == nullptr) return path;
+        return string(homeDir).append(nameEnd);
+    }
+
+    // Returns the first component of pattern containing wildcards, or nullptr
+    // if there is none.
+    const char * findWildcards(const char * pattern)
+    {
+        for (const char * component = pattern; *component != '\0';)
+        {
+            const char * componentEnd = strchrnul(component, '/');
+            if (hasWildcards(component, componentEnd)) return component;
+            component = componentEnd;
+            while (*component == '/') ++component;
+        }
+        return nullptr;
+    }
+
+    // Like glob, considers an opening bracket a wildcard only if it is matched
+    // by a closing bracket.
+    bool hasWildcards(const char * begin, const char * end)
+    {
+        for (const char * pch = begin; pch != end; ++pch)
+        {
+            switch (*pch)
+            {
+            case '*':
+            case '?':
+                return true;
+            case '[':
+                if (find(pch + 1, end, ']') != end) return true;
+                break;
+            }
+        }
+        return false;
+    }
+
+    bool isRegularFile(int dirFd, const char * name, unsigned char type)
+    {
+        switch (type)
+        {
+        case DT_REG:
+            return true;
+        case DT_LNK:
+        case DT_UNKNOWN:
+            {
+                // Symbolic links are followed like stat does.
+                struct stat st;
+                return fstatat(dirFd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+            }
+        default:
+            return false;
+        }
+    }
+
+    // Calls processEntry for every entry of the directory fd refers to,
+    // reading the entries in large blocks.
+    void readDirectory(int fd, function<void (const dirent64 &)> processEntry)
+    {
+        unique_ptr<char[]> buffer(new char[DirectoryBufferSize]);
+        for (;;)
+        {
+            long result =
+                syscall(SYS_getdents64, fd, buffer.get(), DirectoryBufferSize);
+            if (result == 0) break;
+            if (result < 0) throwFailure(errno, errc::io_error);
+
+            for (long offset = 0; offset < result;)
+            {
+                const dirent64 & entry =
+                    *reinterpret_cast<const dirent64 *>(&buffer[offset]);
+                offset += entry.d_reclen;
+                processEntry(entry);
+            }
+        }
+    }
+
+    void throwFailure(int error, errc internalErrc)
+    {
+        if (error == ENOMEM) throw bad_alloc();
+        throw ios_base::failure(strerror(error), make_error_code(internalErrc));
+    }
+}
+
+void createDirectories(const xchar * dirPath)
+{
+    string path(dirPath);
+    for (size_t index = path.find('/', 1);; index = path.find('/', index + 1))
+    {
+        mkdir(path.substr(0, index).c_str(), 0777);
+        if (index == string::npos) break;
+    }
+}
+
+vector<xstring> findFilePaths(const xchar * path, bool & wildcardsUsed)
+{
+    vector<xstring> filePaths;
+    {
+        string pattern = expandTilde(path);
+        expandPattern(AT_FDCWD, string(), pattern.c_str(), filePaths);
+        if (filePaths.empty())
+            throwFailure(ENOENT, errc::no_such_file_or_directory);
+        filePaths.shrink_to_fit();
+        sort(filePaths.begin(), filePaths.end());
+        wildcardsUsed = findWildcards(pattern.c_str()) != nullptr;
+    }
+    return filePaths;
+}
+
+// Follows the XDG Base Directory Specification.
+xstring getCacheDirPath()
+{
+    const char * cacheDirPath = getenv("XDG_CACHE_HOME");
+    if (cacheDirPath != nullptr && cacheDirPath[0] == '/')
+        return appendPathComponent(cacheDirPath, "mp3epoc");
+    string homeDirPath = expandTilde("~");
+    if (homeDirPath[0] != '/') return getPrivateTempDirPath("mp3epoc");
+    return appendPathComponent(homeDirPath, ".cache/mp3epoc");
+}
+
+bool getFileIdentity(const xchar * path, FileIdentity & identity)
+{
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return false;
+    identity.device = static_cast<uint64_t>(st.st_dev);
+    identity.fileNumber = static_cast<uint64_t>(st.st_ino);
+    identity.size = static_cast<uint64_t>(st.st_size);
+    identity.modificationTime =
+        static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 +
+        static_cast<uint64_t>(st.st_mtim.tv_nsec);
+    return true;
+}
+
+const xchar * getFileName(const xchar * path)
+{
+    const char * fileName = path;
+    for (const char * pch = path;;)
+    {
+        int ch = *pch;
+        if (ch == '\0') break;
+        ++pch;
+        if (ch == '/') fileName = pch;
+    }
+    return fileName;
+}
+
+bool isDirectory(const xchar * path)
+{
+    struct stat st;
+    return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+void
+    listDirectory(
+    const xstring & dirPath,
+    const xchar * pattern,
+    vector<xstring> & filePaths,
+    vector<xstring> & subdirPaths)
+{
+    int fd =
+        open(
+        dirPath.empty() ? "." : dirPath.c_str(),
+        O_RDONLY | O_DIRECTORY | O_CLOEXEC
+        );
+    if (fd < 0)
+    {
+        int error = errno;
+        throwFailure(error, static_cast<errc>(error));
+    }
+    Finally fin(
+        [fd]
+        {
+            close(fd);
+        }
+        );
+    readDirectory(
+        fd,
+        [&] (const dirent64 & entry)
+        {
+            const char * name = entry.d_name;
+            if (
+                name[0] == '.' &&
+                (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+                return;
+
+            // Links to directories are not followed, since they could lead
+            // into a cycle, while links to regular files are.
+            unsigned char type = entry.d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return;
+                type = IFTODT(st.st_mode);
+            }
+            if (type == DT_DIR)
+                subdirPaths.push_back(appendPathComponent(dirPath, name));
+            else if (
+                (type == DT_REG || type == DT_LNK) &&
+                fnmatch(pattern, name, FNM_NOESCAPE | FNM_PERIOD) == 0 &&
+                isRegularFile(fd, name, type))
+                filePaths.push_back(appendPathComponent(dirPath, name));
+        }
+        );
+}
+
+#endif // #if defined(__APPLE__)
+
+namespace
+{
+    // Distinguishes the temporary files written by the threads of a process.
+    atomic<unsigned int> tempFileCounter(0);
+}
+
+xstring getTempFilePath(const xstring & filePath)
+{
+    xostringstream tempFilePath;
+    tempFilePath <<
+        filePath << XSTR('.') << getProcessId() << XSTR('.') <<
+        tempFileCounter++;
+    return tempFilePath.str();
+}
@@ -2,10 +2,49 @@
 
 #include "xsys.h"
 
+#include <cstdint>
 #include <string>
 #include <vector>
 
+// Identifies a file and the state of its contents. The contents of a file are
+// assumed to be unchanged as long as its size and modification time are.
+struct FileIdentity
+{
+    uint64_t device;
+    uint64_t fileNumber;
+    uint64_t size;
+    uint64_t modificationTime;
+};
+
+// Creates dirPath and all missing parent directories. Errors are ignored.
+void createDirectories(const xchar * dirPath);
 std::vector<std::xstring>
     findFilePaths(const xchar * path, bool & wildcardsUsed);
+// Returns the directory where data of the current user is kept that can be
+// recreated at any time, or an empty string if there is none that only the
+// current user can write.
+std::xstring getCacheDirPath();
+// Returns false if path does not specify an existing regular file.
+bool getFileIdentity(const xchar * path, FileIdentity & identity);
 const xchar * getFileName(const xchar * path);
+// Returns the path of a temporary file next to filePath, whose name no other
+// thread or process uses at the same time.
+std::xstring getTempFilePath(const std::xstring & filePath);
 bool isDirectory(const xchar * path);
+
+// Lists the directory dirPath, which may be empty for the current directory.
+// The paths of the regular files whose names match pattern are added to
+// filePaths, the paths of all subdirectories except links are added to
+// subdirPaths, both in no particular order.
+void
+    listDirectory(
+    const std::xstring & dirPath,
+    const xchar * pattern,
+    std::vector<std::xstring> & filePaths,
+    std::vector<std::xstring> & subdirPaths
+    );
+// Deletes the file filePath. Errors are ignored.
+void removeFile(const xchar * filePath);
+// Replaces the file destPath with the file srcPath at once, so that other
+// processes see either file as a whole. Returns false if that fails.
+bool replaceFile(const xchar * srcPath, const xchar * destPath);
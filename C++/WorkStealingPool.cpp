@@ -0,0 +1,112 @@
+#include "WorkStealingPool.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+WorkStealingPool::WorkStealingPool(
+    unsigned int threadCount,
+    size_t taskCount,
+    Task task):
+    task(task),
+    canceled(false)
+{
+    if (threadCount == 0)
+        throw invalid_argument("Thread count must be > 0");
+
+    queues.reserve(threadCount);
+    for (unsigned int threadIndex = 0; threadIndex < threadCount; ++threadIndex)
+        queues.push_back(unique_ptr<Queue>(new Queue));
+    for (size_t taskIndex = 0; taskIndex < taskCount; ++taskIndex)
+        queues[taskIndex % threadCount]->taskIndices.push_back(taskIndex);
+
+    threads.reserve(threadCount);
+    try
+    {
+        for (
+            unsigned int threadIndex = 0;
+            threadIndex < threadCount;
+            ++threadIndex)
+        {
+            threads.push_back(
+                thread(&WorkStealingPool::work, this, threadIndex)
+                );
+        }
+    }
+    catch (...)
+    {
+        cancel();
+        for (thread & workerThread: threads) workerThread.join();
+        throw;
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    cancel();
+    for (thread & workerThread: threads)
+        if (workerThread.joinable()) workerThread.join();
+}
+
+// Lets the threads finish their current tasks, but start no further tasks.
+void WorkStealingPool::cancel()
+{
+    canceled = true;
+}
+
+// Waits until all threads have finished. If a task has thrown an exception,
+// the remaining tasks are not started, and the exception is rethrown here.
+void WorkStealingPool::join()
+{
+    for (thread & workerThread: threads)
+        if (workerThread.joinable()) workerThread.join();
+    if (exception)
+    {
+        exception_ptr exception;
+        swap(exception, this->exception);
+        rethrow_exception(exception);
+    }
+}
+
+bool WorkStealingPool::takeTask(unsigned int threadIndex, size_t & taskIndex)
+{
+    {
+        Queue & queue = *queues[threadIndex];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.taskIndices.empty())
+        {
+            taskIndex = queue.taskIndices.front();
+            queue.taskIndices.pop_front();
+            return true;
+        }
+    }
+    size_t queueCount = queues.size();
+    for (size_t offset = 1; offset < queueCount; ++offset)
+    {
+        Queue & queue = *queues[(threadIndex + offset) % queueCount];
+        lock_guard<mutex> lock(queue.mutex);
+        if (!queue.taskIndices.empty())
+        {
+            taskIndex = queue.taskIndices.back();
+            queue.taskIndices.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::work(unsigned int threadIndex)
+{
+    try
+    {
+        size_t taskIndex;
+        while (!canceled && takeTask(threadIndex, taskIndex))
+            task(threadIndex, taskIndex);
+    }
+    catch (...)
+    {
+        lock_guard<mutex> lock(exceptionMutex);
+        if (!exception) exception = current_exception();
+        canceled = true;
+    }
+}
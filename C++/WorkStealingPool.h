@@ -0,0 +1,46 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs the tasks numbered from 0 to taskCount - 1 on a fixed number of
+// threads. The tasks are dealt round-robin to one queue per thread. Each thread
+// takes tasks from the front of its own queue, so that tasks start roughly in
+// ascending order, and steals tasks from the back of the other queues once its
+// own queue is empty.
+class WorkStealingPool
+{
+public:
+    typedef
+        std::function<void (unsigned int threadIndex, size_t taskIndex)>
+        Task;
+
+    WorkStealingPool(unsigned int threadCount, size_t taskCount, Task task);
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    ~WorkStealingPool();
+    void cancel();
+    void join();
+    WorkStealingPool & operator = (const WorkStealingPool &) = delete;
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<size_t> taskIndices;
+    };
+
+    const Task task;
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<bool> canceled;
+    std::exception_ptr exception;
+    std::mutex exceptionMutex;
+    bool takeTask(unsigned int threadIndex, size_t & taskIndex);
+    void work(unsigned int threadIndex);
+};
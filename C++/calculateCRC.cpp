@@ -0,0 +1,82 @@
+#include "calculateCRC.h"
+
+#include <cstddef>
+
+namespace
+{
+    const int GeneratorPolynomial = 0x8005;
+
+    // Enough zero bytes to stand in for the largest protected data.
+    const uint8_t ZeroBytes[32] = { };
+
+    // tables[n][value] is the CRC of the byte value followed by n zero bytes.
+    class CRCTables
+    {
+    public:
+        uint16_t tables[8][256];
+        CRCTables();
+    };
+
+    const CRCTables crcTables;
+
+    int updateCRC(int crc, const uint8_t * data, size_t length);
+
+    CRCTables::CRCTables()
+    {
+        for (int value = 0; value < 256; ++value)
+        {
+            int crc = value << 8;
+            for (int bit = 0; bit < 8; ++bit)
+                crc = crc & 0x8000 ? crc << 1 ^ GeneratorPolynomial : crc << 1;
+            tables[0][value] = static_cast<uint16_t>(crc);
+        }
+        for (int index = 1; index < 8; ++index)
+            for (int value = 0; value < 256; ++value)
+            {
+                int crc = tables[index - 1][value];
+                tables[index][value] =
+                    static_cast<uint16_t>(crc << 8 ^ tables[0][crc >> 8]);
+            }
+    }
+
+    // Slice-by-8: each iteration folds eight bytes into the CRC with one table
+    // lookup per byte.
+    int updateCRC(int crc, const uint8_t * data, size_t length)
+    {
+        const uint16_t (* tables)[256] = crcTables.tables;
+        for (; length >= 8; length -= 8, data += 8)
+        {
+            crc ^= data[0] << 8 | data[1];
+            crc =
+                tables[7][crc >> 8] ^ tables[6][crc & 0xff] ^
+                tables[5][data[2]] ^ tables[4][data[3]] ^
+                tables[3][data[4]] ^ tables[2][data[5]] ^
+                tables[1][data[6]] ^ tables[0][data[7]];
+        }
+        for (; length > 0; --length, ++data)
+            crc = (crc << 8 & 0xffff) ^ tables[0][crc >> 8 ^ *data];
+        return crc;
+    }
+}
+
+int calculateCRC(int size, const uint8_t buffer[])
+{
+    int crc = 0xffff; // start with inverted value of 0
+    crc = updateCRC(crc, buffer + 2, 2);
+    crc = updateCRC(crc, buffer + 6, size - 6);
+    return crc;
+}
+
+int calculateCRCDelta(int size, int headerDelta)
+{
+    // The CRC of the difference of two messages, starting from 0, is the
+    // difference of their CRCs. Everything but the header bytes is 0 here.
+    const uint8_t headerBytes[] =
+    {
+        static_cast<uint8_t>(headerDelta >> 8),
+        static_cast<uint8_t>(headerDelta)
+    };
+    int crc = updateCRC(0, headerBytes, 2);
+    crc = updateCRC(crc, ZeroBytes, size - 6);
+    return crc;
+}
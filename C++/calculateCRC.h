@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Calculates the CRC-16 of an MPEG audio frame, covering the last two bytes of
+// the frame header and the protected data from byte 6 up to size - 1. Bytes 4
+// and 5 hold the CRC itself and are skipped.
+int calculateCRC(int size, const uint8_t buffer[]);
+
+// Since the CRC is linear, changing bits in the last two bytes of the header
+// of a frame with the given protected size changes its CRC by a value that
+// only depends on the changed bits. This function returns that value, which
+// has to be XORed to the CRC. headerDelta is the XOR of the old and the new
+// values of the last two header bytes, most significant byte first.
+int calculateCRCDelta(int size, int headerDelta);
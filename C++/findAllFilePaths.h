@@ -2,55 +2,116 @@
 
 #include "getResourceString.h"
 #include "PathProcessor.h"
+#include "walkDirectoryTree.h"
 
 #include <functional>
 #include <ios>
+#include <system_error>
+#include <utility>
 
 namespace
 {
+    // Returns the id of the message describing the error e finding the files
+    // specified by a path.
+    inline RESID getPathErrorFormatId(const std::ios_base::failure & e)
+    {
+        switch (e.code().value())
+        {
+        case EINVAL:
+            return MSG_BAD_PATH;
+        case EACCES:
+            return MSG_ACCESS_DENIED;
+        default:
+            return MSG_PATH_NOT_FOUND;
+        }
+    }
+
+    // Passes the paths of the files specified by paths to addFilePath, and the
+    // errors to logError. If recursive is true, every path is searched in its
+    // directory and in all subdirectories with walkThreadCount threads; unless
+    // sorted is true, the files found are then passed on in no particular
+    // order as soon as they are found. Returns -1 if any error occurred, or
+    // else the number of paths that could have specified more than one file.
     template <typename T>
     int findAllFilePaths(
         std::function<void(const std::xstring &)> logError,
         const T & paths,
-        std::vector<const std::xstring> & filePaths)
+        bool recursive,
+        unsigned int walkThreadCount,
+        bool sorted,
+        std::function<void(std::xstring &&)> addFilePath)
     {
         int result = 0;
 
+        // Subdirectories that cannot be listed are reported, but the rest of
+        // the tree is still searched.
+        auto logFailure =
+            [&logError, &result]
+            (const std::xstring & dirPath, const std::ios_base::failure & e)
+            {
+                result = -1;
+                logError(
+                    getResourceString(
+                    getPathErrorFormatId(e),
+                    quotePath(dirPath).c_str()
+                    )
+                    );
+            };
+
         for (const std::xstring & path: paths)
         {
             RESID errorFormatId;
 
             // If any of the specified paths is a directory, provide a useful
-            // error description.
-            if (isDirectory(path.c_str()))
+            // error description, unless directories are searched recursively.
+            if (!recursive && isDirectory(path.c_str()))
                 errorFormatId = MSG_PATH_IS_DIR;
             else
             {
                 try
                 {
-                    bool wildcardsUsed;
-                    std::vector<std::xstring> newFilePaths =
-                        findFilePaths(path.c_str(), wildcardsUsed);
+                    bool wildcardsUsed = true;
+                    if (recursive && !sorted)
+                    {
+                        size_t fileCount = 0;
+                        walkDirectoryTree(
+                            path.c_str(),
+                            walkThreadCount,
+                            [&addFilePath, &fileCount]
+                            (std::xstring && filePath)
+                            {
+                                ++fileCount;
+                                addFilePath(std::move(filePath));
+                            },
+                            logFailure
+                            );
+                        if (fileCount == 0)
+                            throw
+                            std::ios_base::failure(
+                            "No files found",
+                            std::make_error_code(
+                            std::errc::no_such_file_or_directory)
+                            );
+                    }
+                    else
+                    {
+                        std::vector<std::xstring> newFilePaths =
+                            recursive ?
+                            findFilePathsRecursively(
+                            path.c_str(),
+                            walkThreadCount,
+                            logFailure
+                            ) :
+                            findFilePaths(path.c_str(), wildcardsUsed);
+                        for (std::xstring & filePath: newFilePaths)
+                            addFilePath(std::move(filePath));
+                    }
                     if (result >= 0 && wildcardsUsed) ++result;
-                    filePaths.reserve(filePaths.size() + newFilePaths.size());
-                    for (std::xstring & filePath: newFilePaths)
-                        filePaths.push_back(move(filePath));
                     continue;
                 }
                 catch (const std::ios_base::failure & e)
                 {
-                    switch (e.code().value())
-                    {
-                    case EINVAL:
-                        errorFormatId = MSG_BAD_PATH;
-                        break;
-                    case EACCES:
-                        errorFormatId = MSG_ACCESS_DENIED;
-                        break;
-                    default:
-                        errorFormatId = MSG_PATH_NOT_FOUND;
-                        break;
-                    }
+                    errorFormatId = getPathErrorFormatId(e);
                 }
             }
             result = -1;
@@ -60,4 +121,35 @@ namespace
         }
         return result;
     }
+
+    template <typename T>
+    int findAllFilePaths(
+        std::function<void(const std::xstring &)> logError,
+        const T & paths,
+        bool recursive,
+        unsigned int walkThreadCount,
+        std::vector<std::xstring> & filePaths)
+    {
+        return
+            findAllFilePaths(
+            logError,
+            paths,
+            recursive,
+            walkThreadCount,
+            true,
+            [&filePaths] (std::xstring && filePath)
+            {
+                filePaths.push_back(std::move(filePath));
+            }
+            );
+    }
+
+    template <typename T>
+    int findAllFilePaths(
+        std::function<void(const std::xstring &)> logError,
+        const T & paths,
+        std::vector<std::xstring> & filePaths)
+    {
+        return findAllFilePaths(logError, paths, false, 1, filePaths);
+    }
 }
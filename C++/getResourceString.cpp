@@ -118,6 +118,255 @@ xstring getResourceString(RESID id, ...)
     return result;
 }
 
+#elif defined(__linux__) // #if defined(_WIN32)
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <unistd.h>
+#include <vector>
+
+using namespace std;
+
+// Like on macOS, the strings are read from the file Localizable.strings in the
+// directory <language>.lproj next to the executable. Its format is the same:
+// lines of the form "key"="value"; in UTF-16 with a byte order mark.
+namespace
+{
+    typedef map<string, string> StringTable;
+
+    void appendUTF8(string & text, uint32_t codePoint);
+    string decodeUTF16(const vector<uint8_t> & data);
+    string getExecutableDirPath();
+    string getLanguage();
+    const StringTable & getStringTable();
+    bool loadStringTable(const string & filePath, StringTable & stringTable);
+    bool parseQuotedString(const string & text, size_t & index, string & value);
+    void skipSpaces(const string & text, size_t & index);
+
+    void appendUTF8(string & text, uint32_t codePoint)
+    {
+        if (codePoint < 0x80)
+            text += static_cast<char>(codePoint);
+        else if (codePoint < 0x800)
+        {
+            text += static_cast<char>(0xc0 | codePoint >> 6);
+            text += static_cast<char>(0x80 | (codePoint & 0x3f));
+        }
+        else if (codePoint < 0x10000)
+        {
+            text += static_cast<char>(0xe0 | codePoint >> 12);
+            text += static_cast<char>(0x80 | (codePoint >> 6 & 0x3f));
+            text += static_cast<char>(0x80 | (codePoint & 0x3f));
+        }
+        else
+        {
+            text += static_cast<char>(0xf0 | codePoint >> 18);
+            text += static_cast<char>(0x80 | (codePoint >> 12 & 0x3f));
+            text += static_cast<char>(0x80 | (codePoint >> 6 & 0x3f));
+            text += static_cast<char>(0x80 | (codePoint & 0x3f));
+        }
+    }
+
+    // Converts UTF-16 text to UTF-8. Without a byte order mark, the text is
+    // taken to be big-endian.
+    string decodeUTF16(const vector<uint8_t> & data)
+    {
+        string text;
+        size_t size = data.size() & ~size_t(1);
+        size_t index = 0;
+        bool bigEndian = true;
+        if (size >= 2 && data[0] == 0xff && data[1] == 0xfe)
+        {
+            bigEndian = false;
+            index = 2;
+        }
+        else if (size >= 2 && data[0] == 0xfe && data[1] == 0xff)
+            index = 2;
+        auto readUnit =
+            [&data, bigEndian] (size_t index)
+            {
+                return
+                    bigEndian ?
+                    static_cast<uint32_t>(data[index] << 8 | data[index + 1]) :
+                    static_cast<uint32_t>(data[index + 1] << 8 | data[index]);
+            };
+        text.reserve(size / 2);
+        for (; index < size; index += 2)
+        {
+            uint32_t codePoint = readUnit(index);
+            if (codePoint >= 0xd800 && codePoint < 0xdc00 && index + 4 <= size)
+            {
+                uint32_t lowSurrogate = readUnit(index + 2);
+                if (lowSurrogate >= 0xdc00 && lowSurrogate < 0xe000)
+                {
+                    codePoint =
+                        0x10000 +
+                        ((codePoint - 0xd800) << 10) +
+                        (lowSurrogate - 0xdc00);
+                    index += 2;
+                }
+            }
+            appendUTF8(text, codePoint);
+        }
+        return text;
+    }
+
+    string getExecutableDirPath()
+    {
+        vector<char> buffer(0x1000);
+        ssize_t length =
+            readlink("/proc/self/exe", buffer.data(), buffer.size());
+        if (length <= 0 || static_cast<size_t>(length) >= buffer.size())
+            return ".";
+        string path(buffer.data(), static_cast<size_t>(length));
+        size_t dirPathLength = path.find_last_of('/');
+        return dirPathLength != 0 ? path.substr(0, dirPathLength) : "/";
+    }
+
+    // Returns the language of the messages, as selected by the usual
+    // environment variables, without the territory and the encoding.
+    string getLanguage()
+    {
+        const char * names[] = { "LANGUAGE", "LC_ALL", "LC_MESSAGES", "LANG" };
+        for (const char * name: names)
+        {
+            const char * value = getenv(name);
+            if (value == nullptr || value[0] == '\0') continue;
+            string language(value);
+            language = language.substr(0, language.find_first_of(":_.@"));
+            if (language == "C" || language == "POSIX") break;
+            if (!language.empty()) return language;
+        }
+        return "en";
+    }
+
+    // Falls back to the English strings if there are none for the language.
+    const StringTable & getStringTable()
+    {
+        static const StringTable stringTable =
+            []
+            {
+                string dirPath = getExecutableDirPath();
+                StringTable stringTable;
+                if (
+                    !loadStringTable(
+                    dirPath + "/" + getLanguage() +
+                    ".lproj/Localizable.strings",
+                    stringTable))
+                {
+                    loadStringTable(
+                        dirPath + "/en.lproj/Localizable.strings",
+                        stringTable
+                        );
+                }
+                return stringTable;
+            }();
+        return stringTable;
+    }
+
+    bool loadStringTable(const string & filePath, StringTable & stringTable)
+    {
+        ifstream stream(filePath.c_str(), ios_base::binary);
+        if (!stream) return false;
+        string text =
+            decodeUTF16(
+            vector<uint8_t>(
+            istreambuf_iterator<char>(stream),
+            istreambuf_iterator<char>()
+            ));
+        size_t index = 0;
+        if (text.compare(0, 3, "\xef\xbb\xbf") == 0) index = 3;
+        for (;;)
+        {
+            string key, value;
+            skipSpaces(text, index);
+            if (!parseQuotedString(text, index, key)) break;
+            skipSpaces(text, index);
+            if (index >= text.length() || text[index] != '=') break;
+            skipSpaces(text, ++index);
+            if (!parseQuotedString(text, index, value)) break;
+            skipSpaces(text, index);
+            if (index >= text.length() || text[index] != ';') break;
+            ++index;
+            stringTable[key] = value;
+        }
+        return !stringTable.empty();
+    }
+
+    bool parseQuotedString(const string & text, size_t & index, string & value)
+    {
+        if (index >= text.length() || text[index] != '"') return false;
+        for (++index; index < text.length(); ++index)
+        {
+            char ch = text[index];
+            if (ch == '"')
+            {
+                ++index;
+                return true;
+            }
+            if (ch == '\\' && ++index < text.length())
+            {
+                ch = text[index];
+                switch (ch)
+                {
+                case 'n':
+                    ch = '\n';
+                    break;
+                case 'r':
+                    ch = '\r';
+                    break;
+                case 't':
+                    ch = '\t';
+                    break;
+                }
+            }
+            value += ch;
+        }
+        return false;
+    }
+
+    void skipSpaces(const string & text, size_t & index)
+    {
+        while (
+            index < text.length() &&
+            (text[index] == ' ' || text[index] == '\t' ||
+            text[index] == '\r' || text[index] == '\n'))
+            ++index;
+    }
+}
+
+xstring getResourceFormat(RESID id)
+{
+    const StringTable & stringTable = getStringTable();
+    StringTable::const_iterator iterator = stringTable.find(id);
+    return iterator != stringTable.end() ? iterator->second : string(id);
+}
+
+xstring getResourceString(RESID id, ...)
+{
+    string format = getResourceFormat(id);
+    va_list args;
+    va_start(args, id);
+    va_list argsCopy;
+    va_copy(argsCopy, args);
+    int length = vsnprintf(nullptr, 0, format.c_str(), argsCopy);
+    va_end(argsCopy);
+    string result;
+    if (length > 0)
+    {
+        vector<char> buffer(static_cast<size_t>(length) + 1);
+        vsnprintf(buffer.data(), buffer.size(), format.c_str(), args);
+        result.assign(buffer.data(), static_cast<size_t>(length));
+    }
+    va_end(args);
+    return result;
+}
+
 #endif // #if defined(_WIN32)
 
 xstring quotePath(const xstring & path)
@@ -5,5 +5,12 @@
 
 #include <string>
 
+#if defined(__linux__)
+
+// Returns the string for id, without replacing its inserts.
+std::xstring getResourceFormat(RESID id);
+
+#endif // #if defined(__linux__)
+
 std::xstring getResourceString(RESID id, ...);
 std::xstring quotePath(const std::xstring & path);
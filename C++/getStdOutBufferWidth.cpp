@@ -12,7 +12,7 @@ int getStdOutBufferWidth()
         csbi.dwSize.X : -1;
 }
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+#elif defined(__APPLE__) || defined(__linux__) // #if defined(_WIN32)
 
 #include <sys/ioctl.h>
 #include <unistd.h>
@@ -16,4 +16,12 @@ typedef unsigned long DWORD;
 
 #include "osxres/messages.h"
 
+#elif defined(__linux__) // #if defined(_WIN32)
+
+// The strings are identified by the same keys as on macOS.
+#define CFSTR(cStr) cStr
+#define RESID const char *
+
+#include "osxres/messages.h"
+
 #endif // #if defined(_WIN32)
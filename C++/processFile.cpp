@@ -1,19 +1,149 @@
+#include "BoundedQueue.h"
+#include "Finally.h"
 #include "getResourceString.h"
 #include "MP3FormatException.h"
 #include "PathProcessor.h"
 #include "processFile.h"
+#include "WorkStealingPool.h"
 
+#include <condition_variable>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
 
 using namespace MP3epoc;
 using namespace std;
 
+namespace
+{
+    // The number of paths found but not yet processed is limited, so that the
+    // memory required does not depend on the number of files.
+    const size_t FilePathQueueCapacity = 0x400;
+
+    vector<unique_ptr<MP3GearWheel>>
+        cloneGearWheel(const MP3GearWheel & gearWheel, unsigned int count);
+    void
+        countFile(
+        ProcessFileResult processFileResult,
+        int & processedFileCount,
+        int & modifiedFileCount,
+        int & listedFileCount
+        );
+    ProcessFileResult
+        showFile(
+        const xstring & filePath,
+        MP3AttributeSet attributeSetBefore,
+        const MP3GearWheel & gearWheel,
+        MP3AttributeSet attributeSetToView,
+        bool invertMatch,
+        xchar formatSpec,
+        xostream & outputStream
+        );
+
+    // Every thread uses its own clone of gearWheel.
+    vector<unique_ptr<MP3GearWheel>>
+        cloneGearWheel(const MP3GearWheel & gearWheel, unsigned int count)
+    {
+        vector<unique_ptr<MP3GearWheel>> gearWheels;
+        gearWheels.reserve(count);
+        for (unsigned int index = 0; index < count; ++index)
+            gearWheels.push_back(gearWheel.clone());
+        return gearWheels;
+    }
+
+    void
+        countFile(
+        ProcessFileResult processFileResult,
+        int & processedFileCount,
+        int & modifiedFileCount,
+        int & listedFileCount)
+    {
+        switch (processFileResult)
+        {
+        case ProcessFileResult::Modified:
+            ++modifiedFileCount;
+            ++processedFileCount;
+            break;
+        case ProcessFileResult::Listed:
+            ++listedFileCount;
+            // fall through
+        case ProcessFileResult::Unmodified:
+            ++processedFileCount;
+            break;
+        case ProcessFileResult::Unprocessed:
+            break;
+        }
+    }
+
+    // Shows the file processed if it is selected, and returns the result of
+    // processing it.
+    ProcessFileResult
+        showFile(
+        const xstring & filePath,
+        MP3AttributeSet attributeSetBefore,
+        const MP3GearWheel & gearWheel,
+        MP3AttributeSet attributeSetToView,
+        bool invertMatch,
+        xchar formatSpec,
+        xostream & outputStream)
+    {
+        if (!attributeSetBefore.matches(gearWheel.getAttributeSetToApply()))
+            return ProcessFileResult::Modified;
+        if (
+            formatSpec == XSTR('\0') ||
+            attributeSetBefore.matches(attributeSetToView) == invertMatch)
+            return ProcessFileResult::Unmodified;
+
+        switch (formatSpec)
+        {
+        case XSTR('N'):
+            outputStream << filePath << endl;
+            break;
+        case XSTR('T'):
+            break;
+        default:
+            {
+                bool useCompactFormat = formatSpec == XSTR('S');
+                outputStream <<
+                    attributeSetBefore.toString(useCompactFormat) <<
+                    XSTR("    ") << getFileName(filePath.c_str()) << endl;
+            }
+            break;
+        }
+        return ProcessFileResult::Listed;
+    }
+}
+
 ProcessFileResult
     processFile(
     const xstring & filePath,
     MP3GearWheel & gearWheel,
     MP3AttributeSet attributeSetToView,
+    bool invertMatch,
     xchar formatSpec)
+{
+    return
+        processFile(
+        filePath,
+        gearWheel,
+        attributeSetToView,
+        invertMatch,
+        formatSpec,
+        xcout
+        );
+}
+
+ProcessFileResult
+    processFile(
+    const xstring & filePath,
+    MP3GearWheel & gearWheel,
+    MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    xostream & outputStream)
 {
     MP3AttributeSet attributeSetBefore;
     try
@@ -34,23 +164,304 @@ ProcessFileResult
         // Errors in file processing are printed to the standard output stream
         // rather than the standard error output stream in order to keep all
         // information in one listing when the output is redirected.
-        xcout <<
+        outputStream <<
             getResourceString(MSG_ERROR) << XSTR(": ") << e.getMessage() <<
             endl;
         return ProcessFileResult::Unprocessed;
     }
 
-    if (
-        formatSpec != XSTR('\0') &&
-        attributeSetBefore.matches(attributeSetToView))
+    return
+        showFile(
+        filePath,
+        attributeSetBefore,
+        gearWheel,
+        attributeSetToView,
+        invertMatch,
+        formatSpec,
+        outputStream
+        );
+}
+
+ProcessFileResult
+    processStdIO(
+    MP3GearWheel & gearWheel,
+    MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec)
+{
+    const xstring filePath = XSTR("-");
+    bool applying = !gearWheel.getAttributeSetToApply().isUnspecified();
+    MP3AttributeSet attributeSetBefore;
+    try
     {
-        bool useCompactFormat = formatSpec == XSTR('S');
-        xcout <<
-            attributeSetBefore.toString(useCompactFormat) << XSTR("    ") <<
-            getFileName(filePath.c_str()) << endl;
+        if (applying)
+        {
+            attributeSetBefore = gearWheel.applyAttributes(cin, cout, filePath);
+            cout.flush();
+        }
+        else
+            attributeSetBefore = gearWheel.readAttributes(cin, filePath);
     }
+    catch (const MP3GenericException & e)
+    {
+        // When attributes are applied, the standard output stream carries the
+        // data of the file.
+        (applying ? xcerr : xcout) <<
+            getResourceString(MSG_ERROR) << XSTR(": ") << e.getMessage() <<
+            endl;
+        return ProcessFileResult::Unprocessed;
+    }
+
     return
-        attributeSetBefore.matches(gearWheel.getAttributeSetToApply()) ?
-        ProcessFileResult::Unmodified :
-        ProcessFileResult::Modified;
+        showFile(
+        filePath,
+        attributeSetBefore,
+        gearWheel,
+        attributeSetToView,
+        invertMatch,
+        formatSpec,
+        xcout
+        );
+}
+
+// With more than one thread, every thread uses its own clone of gearWheel and
+// writes to a buffer. The buffers are printed in the order of filePaths, so the
+// output is the same as with one thread.
+void
+    processFiles(
+    const vector<xstring> & filePaths,
+    const MP3GearWheel & gearWheel,
+    MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    unsigned int threadCount,
+    int & processedFileCount,
+    int & modifiedFileCount,
+    int & listedFileCount)
+{
+    if (threadCount <= 1 || filePaths.size() <= 1)
+    {
+        unique_ptr<MP3GearWheel> threadGearWheel = gearWheel.clone();
+        for (const xstring & filePath: filePaths)
+        {
+            ProcessFileResult processFileResult =
+                processFile(
+                filePath,
+                *threadGearWheel,
+                attributeSetToView,
+                invertMatch,
+                formatSpec
+                );
+            countFile(
+                processFileResult,
+                processedFileCount,
+                modifiedFileCount,
+                listedFileCount
+                );
+        }
+        return;
+    }
+
+    struct FileResult
+    {
+        bool done;
+        ProcessFileResult processFileResult;
+        xstring output;
+        exception_ptr exception;
+    };
+
+    vector<FileResult> fileResults(filePaths.size());
+    for (FileResult & fileResult: fileResults) fileResult.done = false;
+    mutex fileResultMutex;
+    condition_variable fileResultDone;
+    vector<unique_ptr<MP3GearWheel>> threadGearWheels =
+        cloneGearWheel(gearWheel, threadCount);
+
+    WorkStealingPool pool(
+        threadCount,
+        filePaths.size(),
+        [&] (unsigned int threadIndex, size_t fileIndex)
+        {
+            ProcessFileResult processFileResult =
+                ProcessFileResult::Unprocessed;
+            xstring output;
+            exception_ptr exception;
+            try
+            {
+                xostringstream outputStream;
+                processFileResult =
+                    processFile(
+                    filePaths[fileIndex],
+                    *threadGearWheels[threadIndex],
+                    attributeSetToView,
+                    invertMatch,
+                    formatSpec,
+                    outputStream
+                    );
+                output = outputStream.str();
+            }
+            catch (...)
+            {
+                exception = current_exception();
+            }
+            {
+                lock_guard<mutex> lock(fileResultMutex);
+                FileResult & fileResult = fileResults[fileIndex];
+                fileResult.done = true;
+                fileResult.processFileResult = processFileResult;
+                fileResult.output.swap(output);
+                fileResult.exception = exception;
+            }
+            fileResultDone.notify_one();
+        }
+        );
+
+    for (FileResult & fileResult: fileResults)
+    {
+        {
+            unique_lock<mutex> lock(fileResultMutex);
+            fileResultDone.wait(
+                lock,
+                [&fileResult]
+                {
+                    return fileResult.done;
+                }
+                );
+        }
+
+        // A file result is not accessed by the threads once it is done.
+        xcout << fileResult.output << flush;
+        xstring().swap(fileResult.output);
+        if (fileResult.exception) rethrow_exception(fileResult.exception);
+        countFile(
+            fileResult.processFileResult,
+            processedFileCount,
+            modifiedFileCount,
+            listedFileCount
+            );
+    }
+    pool.join();
+}
+
+void
+    processFiles(
+    function<void (function<void (xstring && filePath)> addFilePath)>
+    findFilePaths,
+    const MP3GearWheel & gearWheel,
+    MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    unsigned int threadCount,
+    int & processedFileCount,
+    int & modifiedFileCount,
+    int & listedFileCount)
+{
+    if (threadCount == 0) threadCount = 1;
+
+    BoundedQueue<xstring> filePathQueue(FilePathQueueCapacity);
+    exception_ptr findException;
+    exception_ptr processException;
+    bool findCanceled = false;
+    mutex outputMutex;
+    vector<unique_ptr<MP3GearWheel>> threadGearWheels =
+        cloneGearWheel(gearWheel, threadCount);
+
+    auto
+        work =
+        [&] (unsigned int threadIndex)
+        {
+            try
+            {
+                xstring filePath;
+                while (filePathQueue.pop(filePath))
+                {
+                    xostringstream outputStream;
+                    ProcessFileResult processFileResult =
+                        processFile(
+                        filePath,
+                        *threadGearWheels[threadIndex],
+                        attributeSetToView,
+                        invertMatch,
+                        formatSpec,
+                        outputStream
+                        );
+                    lock_guard<mutex> lock(outputMutex);
+                    xcout << outputStream.str() << flush;
+                    countFile(
+                        processFileResult,
+                        processedFileCount,
+                        modifiedFileCount,
+                        listedFileCount
+                        );
+                }
+            }
+            catch (...)
+            {
+                {
+                    lock_guard<mutex> lock(outputMutex);
+                    if (!processException)
+                        processException = current_exception();
+                }
+                filePathQueue.cancel();
+            }
+        };
+
+    thread findThread(
+        [&]
+        {
+            try
+            {
+                findFilePaths(
+                    [&filePathQueue, &findCanceled] (xstring && filePath)
+                    {
+                        // Stop searching once processing has failed.
+                        if (!filePathQueue.push(move(filePath)))
+                        {
+                            findCanceled = true;
+                            throw exception();
+                        }
+                    }
+                    );
+                filePathQueue.close();
+            }
+            catch (...)
+            {
+                if (!findCanceled) findException = current_exception();
+                filePathQueue.cancel();
+            }
+        }
+        );
+
+    {
+        vector<thread> threads;
+        Finally fin(
+            [&]
+            {
+                for (thread & workerThread: threads) workerThread.join();
+                filePathQueue.cancel();
+                findThread.join();
+            }
+            );
+
+        // The calling thread is one of the threads processing the files.
+        try
+        {
+            threads.reserve(threadCount - 1);
+            for (
+                unsigned int threadIndex = 1;
+                threadIndex < threadCount;
+                ++threadIndex)
+            {
+                threads.push_back(thread(work, threadIndex));
+            }
+        }
+        catch (...)
+        {
+            filePathQueue.cancel();
+            throw;
+        }
+        work(0);
+    }
+    if (processException) rethrow_exception(processException);
+    if (findException) rethrow_exception(findException);
 }
@@ -2,17 +2,82 @@
 
 #include "MP3GearWheel.h"
 
+#include <functional>
+#include <ostream>
+
 enum class ProcessFileResult
 {
     Unprocessed,
     Modified,
     Unmodified,
+    // Unmodified, and selected by attributeSetToView.
+    Listed,
 };
 
+// The files matching attributeSetToView, or not matching it if invertMatch is
+// true, are shown in the format specified by formatSpec: 'L' (extended), 'S'
+// (compact), 'N' (path only) or 'T' (not shown, only counted as listed). If
+// formatSpec is '\0', no files are shown.
+ProcessFileResult
+    processFile(
+    const std::xstring & filePath,
+    MP3epoc::MP3GearWheel & gearWheel,
+    MP3epoc::MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec
+    );
+
 ProcessFileResult
     processFile(
     const std::xstring & filePath,
     MP3epoc::MP3GearWheel & gearWheel,
     MP3epoc::MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    std::xostream & outputStream
+    );
+
+// Processes the file read from the standard input stream like processFile,
+// with - as its path. When attributes are applied, the file is written to the
+// standard output stream, and errors go to the standard error output stream.
+ProcessFileResult
+    processStdIO(
+    MP3epoc::MP3GearWheel & gearWheel,
+    MP3epoc::MP3AttributeSet attributeSetToView,
+    bool invertMatch,
     xchar formatSpec
     );
+
+void
+    processFiles(
+    const std::vector<std::xstring> & filePaths,
+    const MP3epoc::MP3GearWheel & gearWheel,
+    MP3epoc::MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    unsigned int threadCount,
+    int & processedFileCount,
+    int & modifiedFileCount,
+    int & listedFileCount
+    );
+
+// Processes the files while they are still being searched. findFilePaths is
+// invoked on a separate thread and passes the path of every file found to the
+// function it receives, which blocks while too many files are waiting to be
+// processed. The output for every file is written as soon as the file has
+// been processed, so with more than one thread the files are listed in no
+// particular order.
+void
+    processFiles(
+    std::function<
+    void (std::function<void (std::xstring && filePath)> addFilePath)
+    > findFilePaths,
+    const MP3epoc::MP3GearWheel & gearWheel,
+    MP3epoc::MP3AttributeSet attributeSetToView,
+    bool invertMatch,
+    xchar formatSpec,
+    unsigned int threadCount,
+    int & processedFileCount,
+    int & modifiedFileCount,
+    int & listedFileCount
+    );
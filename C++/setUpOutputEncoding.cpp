@@ -17,7 +17,7 @@ void setUpOutputEncoding()
     setUpOutputEncoding(stderr);
 }
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+#elif defined(__APPLE__) || defined(__linux__) // #if defined(_WIN32)
 
 void setUpOutputEncoding()
 {
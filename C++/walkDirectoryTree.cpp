@@ -0,0 +1,202 @@
+#include "PathProcessor.h"
+#include "walkDirectoryTree.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <ios>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+void
+    walkDirectoryTree(
+    const xchar * path,
+    unsigned int threadCount,
+    function<void (xstring && filePath)> processFilePath,
+    function<void (const xstring & dirPath, const ios_base::failure & e)>
+    processFailure)
+{
+    if (threadCount == 0)
+        throw invalid_argument("Thread count must be > 0");
+
+    xstring dirPath;
+    xstring pattern;
+    if (isDirectory(path))
+    {
+        dirPath = path;
+        pattern = XSTR("*");
+    }
+    else
+    {
+        const xchar * fileName = getFileName(path);
+        dirPath.assign(path, fileName);
+        pattern = fileName;
+    }
+
+    // The directory of path is listed on the calling thread, so that errors
+    // are reported to the caller.
+    deque<xstring> pendingDirPaths;
+    {
+        vector<xstring> filePaths;
+        vector<xstring> subdirPaths;
+        listDirectory(dirPath, pattern.c_str(), filePaths, subdirPaths);
+        for (xstring & filePath: filePaths) processFilePath(move(filePath));
+        for (xstring & subdirPath: subdirPaths)
+            pendingDirPaths.push_back(move(subdirPath));
+    }
+    if (pendingDirPaths.empty()) return;
+
+    mutex walkMutex;
+    mutex processMutex;
+    condition_variable walkChanged;
+    unsigned int busyThreadCount = 0;
+    bool stopped = false;
+    exception_ptr exception;
+
+    // The pending directories are taken from the back of the queue, so that
+    // the tree is walked roughly depth first and the queue stays short.
+    auto
+        work =
+        [&] ()
+        {
+            vector<xstring> filePaths;
+            vector<xstring> subdirPaths;
+            unique_lock<mutex> lock(walkMutex);
+            for (;;)
+            {
+                walkChanged.wait(
+                    lock,
+                    [&]
+                    {
+                        return
+                            stopped ||
+                            !pendingDirPaths.empty() ||
+                            busyThreadCount == 0;
+                    }
+                    );
+                if (stopped || pendingDirPaths.empty()) break;
+
+                xstring pendingDirPath = move(pendingDirPaths.back());
+                pendingDirPaths.pop_back();
+                ++busyThreadCount;
+                lock.unlock();
+
+                filePaths.clear();
+                subdirPaths.clear();
+                try
+                {
+                    listDirectory(
+                        pendingDirPath,
+                        pattern.c_str(),
+                        filePaths,
+                        subdirPaths
+                        );
+                }
+                catch (const ios_base::failure & e)
+                {
+                    try
+                    {
+                        if (processFailure)
+                        {
+                            lock_guard<mutex> processLock(processMutex);
+                            processFailure(pendingDirPath, e);
+                        }
+                    }
+                    catch (...)
+                    {
+                        lock.lock();
+                        --busyThreadCount;
+                        if (!exception) exception = current_exception();
+                        stopped = true;
+                        break;
+                    }
+                }
+                catch (...)
+                {
+                    lock.lock();
+                    --busyThreadCount;
+                    if (!exception) exception = current_exception();
+                    stopped = true;
+                    break;
+                }
+
+                lock.lock();
+                --busyThreadCount;
+                for (xstring & subdirPath: subdirPaths)
+                    pendingDirPaths.push_back(move(subdirPath));
+                walkChanged.notify_all();
+                lock.unlock();
+
+                // The other threads go on walking while the files are
+                // processed.
+                try
+                {
+                    lock_guard<mutex> processLock(processMutex);
+                    for (xstring & filePath: filePaths)
+                        processFilePath(move(filePath));
+                }
+                catch (...)
+                {
+                    lock.lock();
+                    if (!exception) exception = current_exception();
+                    stopped = true;
+                    break;
+                }
+                lock.lock();
+            }
+            walkChanged.notify_all();
+        };
+
+    // The calling thread takes part in the walk.
+    vector<thread> threads;
+    threads.reserve(threadCount - 1);
+    try
+    {
+        for (unsigned int index = 1; index < threadCount; ++index)
+            threads.push_back(thread(work));
+        work();
+    }
+    catch (...)
+    {
+        {
+            lock_guard<mutex> lock(walkMutex);
+            if (!exception) exception = current_exception();
+            stopped = true;
+        }
+        walkChanged.notify_all();
+    }
+    for (thread & walkThread: threads) walkThread.join();
+    if (exception) rethrow_exception(exception);
+}
+
+vector<xstring>
+    findFilePathsRecursively(
+    const xchar * path,
+    unsigned int threadCount,
+    function<void (const xstring & dirPath, const ios_base::failure & e)>
+    processFailure)
+{
+    vector<xstring> filePaths;
+    walkDirectoryTree(
+        path,
+        threadCount,
+        [&filePaths] (xstring && filePath)
+        {
+            filePaths.push_back(move(filePath));
+        },
+        processFailure
+        );
+    if (filePaths.empty())
+        throw
+        ios_base::failure(
+        "No files found",
+        make_error_code(errc::no_such_file_or_directory)
+        );
+    sort(filePaths.begin(), filePaths.end());
+    return filePaths;
+}
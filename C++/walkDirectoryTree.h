@@ -0,0 +1,40 @@
+#pragma once
+
+#include "xsys.h"
+
+#include <functional>
+#include <ios>
+#include <string>
+#include <vector>
+
+// Finds the regular files matching the file name pattern of path in the
+// directory of path and in all of its subdirectories. If path is a directory,
+// all regular files in it and in its subdirectories are found.
+// The subdirectories are listed by threadCount threads, which take them from a
+// shared queue. processFilePath is called for every file as soon as it is
+// found, never on more than one thread at a time, and with the files in no
+// particular order. Errors listing the directory of path are thrown as
+// std::ios_base::failure, while subdirectories that cannot be listed are
+// skipped and passed to processFailure, if specified, on the same terms as
+// the files to processFilePath.
+void
+    walkDirectoryTree(
+    const xchar * path,
+    unsigned int threadCount,
+    std::function<void (std::xstring && filePath)> processFilePath,
+    std::function<
+    void (const std::xstring & dirPath, const std::ios_base::failure & e)>
+    processFailure = nullptr
+    );
+
+// Returns the sorted paths of the files found by walkDirectoryTree. Like
+// findFilePaths, throws std::ios_base::failure with the error code
+// no_such_file_or_directory if there are none.
+std::vector<std::xstring>
+    findFilePathsRecursively(
+    const xchar * path,
+    unsigned int threadCount,
+    std::function<
+    void (const std::xstring & dirPath, const std::ios_base::failure & e)>
+    processFailure = nullptr
+    );
@@ -9,6 +9,7 @@
 #define xistringstream  wistringstream
 #define xostringstream  wostringstream
 #define xmain           wmain
+#define xostream        wostream
 #define xregex          wregex
 #define XSTR(str)       XSTR_(str)
 #define XSTR_(str)      L ## str
@@ -23,6 +24,7 @@
 #define xistringstream  istringstream
 #define xostringstream  ostringstream
 #define xmain           main
+#define xostream        ostream
 #define xregex          regex
 #define XSTR(str)       str
 #define xstring         string
@@ -31,6 +33,6 @@
 
 #if _MSC_VER > 1200
 #define DEFAULT_UNREACHABLE default: __assume(0)
-#elif defined __clang__ // #if _MSC_VER > 1200
+#elif defined __clang__ || defined __GNUC__ // #if _MSC_VER > 1200
 #define DEFAULT_UNREACHABLE default: __builtin_unreachable()
 #endif // #if _MSC_VER > 1200
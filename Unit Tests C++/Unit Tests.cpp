@@ -8,17 +8,35 @@
 
 #pragma warning (pop)
 
+#include "BoundedQueue.h"
+#include "calculateCRC.h"
 #include "countLeastSignificantZeros.h"
 #include "Finally.h"
 #include "findAllFilePaths.h"
+#include "MemoryMappedFile.h"
+#include "MP3FrameIndexCache.h"
+#include "MP3ResultCache.h"
+#include "MP3VBRHeader.h"
 #include "MP3FormatException.h"
 #include "processFile.h"
 #include "shrinkTextWidth.h"
-
+#include "walkDirectoryTree.h"
+#include "WorkStealingPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
 #include <functional>
 #include <exception>
+#include <iostream>
+#include <iterator>
+#include <numeric>
 #include <regex>
+#include <sstream>
 #include <sys/stat.h>
+#include <thread>
 
 #ifdef __APPLE__
 
@@ -38,7 +56,7 @@ using namespace std;
 
 #define DIR_SEPARATOR   L"\\"
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+#else // #if defined(_WIN32)
 
 #define HYPHEN          "\xe2\x80\x90"
 #define AUML            "\xc3\xa4"
@@ -66,7 +84,7 @@ xstring getTempDir()
     return wstring(buffer).append(_wtmpnam(nullptr));
 }
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+#else // #if defined(_WIN32)
 
 void createDir(const xstring & path)
 {
@@ -191,6 +209,15 @@ xstring getRawString(RESID id)
     return result;
 }
 
+#elif defined(__linux__) // #if defined(_WIN32)
+
+#define xsregex_iterator sregex_iterator
+
+xstring getRawString(RESID id)
+{
+    return getResourceFormat(id);
+}
+
 #endif // #if defined(_WIN32)
 
 template <typename T>
@@ -225,6 +252,90 @@ xstring getExpectedMessage(RESID id, Args... args)
     return message;
 }
 
+// The read modes in which files can be opened.
+const MP3ReadMode AllReadModes[] =
+{
+    MP3ReadMode::Stream,
+    MP3ReadMode::MemoryMapped,
+    MP3ReadMode::Windowed
+};
+
+vector<uint8_t> makeFrames(int frameCount, uint32_t header = 0xfffb9000);
+vector<uint8_t> makeProtectedFrames(int frameCount);
+MP3AttributeSet
+    makeWholeFileAttributeSet(
+    MP3Attribute attribute,
+    BinaryAttributeStatus status
+    );
+vector<uint8_t> readFile(const xstring & filePath);
+void writeFile(const xstring & filePath, const vector<uint8_t> & data);
+
+// Returns frameCount frames with the given header, filled with zeros. By
+// default, they are frames of MPEG1 Layer III, 128 kbps, 44100 Hz.
+vector<uint8_t> makeFrames(int frameCount, uint32_t header)
+{
+    const uint8_t headerData[] =
+    {
+        static_cast<uint8_t>(header >> 24),
+        static_cast<uint8_t>(header >> 16),
+        static_cast<uint8_t>(header >> 8),
+        static_cast<uint8_t>(header)
+    };
+    size_t frameSize = MP3FrameHeader(headerData).getFrameSize();
+    vector<uint8_t> data(frameCount * frameSize);
+    for (size_t offset = 0; offset < data.size(); offset += frameSize)
+        memcpy(data.data() + offset, headerData, sizeof headerData);
+    return data;
+}
+
+// Returns frameCount frames of MPEG1 Layer III, 128 kbps, 44100 Hz, protected
+// by a CRC.
+vector<uint8_t> makeProtectedFrames(int frameCount)
+{
+    vector<uint8_t> frame(417);
+    const uint8_t header[] = { 0xff, 0xfa, 0x90, 0x00 };
+    memcpy(frame.data(), header, sizeof header);
+    for (size_t index = 6; index < frame.size(); ++index)
+        frame[index] = static_cast<uint8_t>(index);
+    int crc = calculateCRC(38, frame.data());
+    frame[4] = static_cast<uint8_t>(crc >> 8);
+    frame[5] = static_cast<uint8_t>(crc);
+    vector<uint8_t> data;
+    data.reserve(frameCount * frame.size());
+    for (int index = 0; index < frameCount; ++index)
+        data.insert(data.end(), frame.begin(), frame.end());
+    return data;
+}
+
+// Returns an attribute set of the whole file in which only attribute is
+// specified.
+MP3AttributeSet
+    makeWholeFileAttributeSet(
+    MP3Attribute attribute,
+    BinaryAttributeStatus status)
+{
+    MP3AttributeSet attributeSet;
+    attributeSet.initAttributeStatus(attribute, static_cast<int>(status));
+    attributeSet.setWholeFile(true);
+    return attributeSet;
+}
+
+vector<uint8_t> readFile(const xstring & filePath)
+{
+    ifstream stream(filePath.c_str(), ios_base::binary);
+    return
+        vector<uint8_t>(
+        istreambuf_iterator<char>(stream),
+        istreambuf_iterator<char>()
+        );
+}
+
+void writeFile(const xstring & filePath, const vector<uint8_t> & data)
+{
+    ofstream stream(filePath.c_str(), ios_base::binary);
+    stream.write(reinterpret_cast<const char *>(data.data()), data.size());
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // shrinkTextWidth
 
@@ -313,7 +424,7 @@ TEST_CASE("PathProcessor/findFilePaths", "[findFilePaths]")
             );
     };
 
-#elif defined(__APPLE__) // #if defined(_WIN32)
+#else // #if defined(_WIN32)
 
     function<void(const string &, const string &, bool)> createSymlink =
         [] (const string & oldPath, const string & newPath, bool)
@@ -388,6 +499,34 @@ TEST_CASE("PathProcessor/findFilePaths", "[findFilePaths]")
         REQUIRE(!wildcardsUsed);
     }
 
+#ifndef _WIN32
+
+    // Wildcards in directory names are followed through directory links.
+    xstring subdirFilePath =
+        xstring(subdirPath).append(DIR_SEPARATOR XSTR("d"));
+    ofstream(subdirFilePath.c_str()).close();
+    {
+        xstring pattern =
+            xstring(tempDir)
+            .append(DIR_SEPARATOR XSTR("*") DIR_SEPARATOR XSTR("*"));
+        bool wildcardsUsed;
+        auto result = findFilePaths(pattern.c_str(), wildcardsUsed);
+        REQUIRE(result.size() == 2);
+        REQUIRE(result[0] == subdirFilePath);
+        REQUIRE(wildcardsUsed);
+    }
+    {
+        xstring pattern =
+            xstring(tempDir)
+            .append(DIR_SEPARATOR XSTR("?") DIR_SEPARATOR XSTR("d"));
+        bool wildcardsUsed;
+        auto result = findFilePaths(pattern.c_str(), wildcardsUsed);
+        REQUIRE(result.size() == 2);
+        REQUIRE(wildcardsUsed);
+    }
+
+#endif // #ifndef _WIN32
+
 #ifdef _WIN32
 
     SetCurrentDirectoryW(tempDir.c_str());
@@ -403,20 +542,114 @@ TEST_CASE("PathProcessor/findFilePaths", "[findFilePaths]")
 
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// walkDirectoryTree
+
+TEST_CASE("walkDirectoryTree", "[walkDirectoryTree]")
+{
+    xstring rootPath = xstring(tempDir).append(DIR_SEPARATOR XSTR("tree"));
+    vector<xstring> mp3FilePaths;
+    vector<xstring> allFilePaths;
+    {
+        xstring dirPath = rootPath;
+        for (int depth = 0; depth < 3; ++depth)
+        {
+            createDir(dirPath);
+            createDir(xstring(dirPath).append(DIR_SEPARATOR XSTR("empty")));
+            const xchar * fileNames[] =
+            {
+                XSTR("1.mp3"), XSTR("2.mp3"), XSTR("x.txt")
+            };
+            for (const xchar * fileName: fileNames)
+            {
+                xstring filePath =
+                    xstring(dirPath).append(DIR_SEPARATOR).append(fileName);
+                ofstream(filePath.c_str()).close();
+                if (filePath.back() == XSTR('3'))
+                    mp3FilePaths.push_back(filePath);
+                allFilePaths.push_back(filePath);
+            }
+            dirPath.append(DIR_SEPARATOR XSTR("sub"));
+        }
+    }
+    sort(mp3FilePaths.begin(), mp3FilePaths.end());
+    sort(allFilePaths.begin(), allFilePaths.end());
+
+    xstring pattern = xstring(rootPath).append(DIR_SEPARATOR XSTR("*.mp3"));
+    for (unsigned int threadCount = 1; threadCount <= 4; threadCount *= 2)
+    {
+        REQUIRE(
+            findFilePathsRecursively(pattern.c_str(), threadCount) ==
+            mp3FilePaths
+            );
+        REQUIRE(
+            findFilePathsRecursively(rootPath.c_str(), threadCount) ==
+            allFilePaths
+            );
+
+        // The files are processed on one thread at a time.
+        vector<xstring> filePaths;
+        atomic<int> callCount(0);
+        bool overlapped = false;
+        walkDirectoryTree(
+            rootPath.c_str(),
+            threadCount,
+            [&filePaths, &callCount, &overlapped] (xstring && filePath)
+            {
+                if (++callCount > 1) overlapped = true;
+                this_thread::sleep_for(chrono::milliseconds(1));
+                filePaths.push_back(move(filePath));
+                --callCount;
+            }
+            );
+        REQUIRE_FALSE(overlapped);
+        sort(filePaths.begin(), filePaths.end());
+        REQUIRE(filePaths == allFilePaths);
+    }
+    testFindFilePaths(
+        [&rootPath]
+        {
+            xstring pattern =
+                xstring(rootPath).append(DIR_SEPARATOR XSTR("*.xyz"));
+            findFilePathsRecursively(pattern.c_str(), 4);
+        }
+        );
+    testFindFilePaths(
+        [&rootPath]
+        {
+            xstring pattern =
+                xstring(rootPath).append(DIR_SEPARATOR XSTR("none"))
+                .append(DIR_SEPARATOR XSTR("*.mp3"));
+            findFilePathsRecursively(pattern.c_str(), 4);
+        }
+        );
+    REQUIRE_THROWS_AS(
+        walkDirectoryTree(
+            pattern.c_str(),
+            4,
+            [] (xstring &&)
+            {
+                throw runtime_error("stop");
+            }
+            ),
+        runtime_error
+        );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // findAllFilePaths
 
 TEST_CASE("findAllFilePaths", "[findAllFilePaths]")
 {
-    vector<const xstring> loggedErrors;
+    vector<xstring> loggedErrors;
     auto logError =
         [&loggedErrors]
         (const xstring & error)
         {
             loggedErrors.push_back(error);
         };
-    vector<const xstring> paths { tempDir };
-    vector<const xstring> filePaths;
+    vector<xstring> paths { tempDir };
+    vector<xstring> filePaths;
     
     int result = findAllFilePaths(logError, paths, filePaths);
     
@@ -428,6 +661,73 @@ TEST_CASE("findAllFilePaths", "[findAllFilePaths]")
     REQUIRE(loggedErrors[0] == expectedMessage);
 }
 
+#if !defined(_WIN32)
+
+TEST_CASE("findAllFilePaths/unlistedSubdir", "[findAllFilePaths]")
+{
+    xstring rootPath = xstring(tempDir).append(DIR_SEPARATOR XSTR("unlisted"));
+    xstring subdirPath = xstring(rootPath).append(DIR_SEPARATOR XSTR("sub"));
+    xstring filePath = xstring(rootPath).append(DIR_SEPARATOR XSTR("1.mp3"));
+    createDir(rootPath);
+    createDir(subdirPath);
+    ofstream(filePath.c_str()).close();
+    chmod(subdirPath.c_str(), 0);
+    Finally fin(
+        [&subdirPath]
+        {
+            chmod(subdirPath.c_str(), S_IRWXU);
+        }
+        );
+
+    // Permissions do not stop the superuser from listing the subdirectory.
+    vector<xstring> subdirFilePaths;
+    vector<xstring> subdirSubdirPaths;
+    try
+    {
+        listDirectory(
+            subdirPath,
+            XSTR("*"),
+            subdirFilePaths,
+            subdirSubdirPaths
+            );
+        WARN("The unlisted subdirectory could be listed");
+        return;
+    }
+    catch (const ios_base::failure &)
+    {
+    }
+
+    vector<xstring> paths { rootPath };
+    xstring expectedMessage =
+        getExpectedMessage(MSG_ACCESS_DENIED, quotePath(subdirPath));
+    for (bool sorted: { true, false })
+    {
+        vector<xstring> loggedErrors;
+        vector<xstring> filePaths;
+        int result =
+            findAllFilePaths(
+            [&loggedErrors] (const xstring & error)
+            {
+                loggedErrors.push_back(error);
+            },
+            paths,
+            true,
+            2,
+            sorted,
+            [&filePaths] (xstring && filePath)
+            {
+                filePaths.push_back(move(filePath));
+            }
+            );
+
+        REQUIRE(result == -1);
+        REQUIRE(filePaths == vector<xstring> { filePath });
+        REQUIRE(loggedErrors == vector<xstring> { expectedMessage });
+    }
+}
+
+#endif // #if !defined(_WIN32)
+
 ////////////////////////////////////////////////////////////////////////////////
 // countLeastSignificantZeros
 
@@ -438,6 +738,165 @@ TEST_CASE("countLeastSignificantZeros", "[countLeastSignificantZeros]")
     REQUIRE(countLeastSignificantZeros(0x80000000) == 31);
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// calculateCRC
+
+// Reference implementation processing one bit per iteration.
+static int calculateCRCBitwise(int size, const uint8_t buffer[]);
+static void fillRandomly(uint8_t buffer[], size_t size);
+
+int calculateCRCBitwise(int size, const uint8_t buffer[])
+{
+    int crc = 0xffff;
+    for (int index = 2;;)
+    {
+        int data = buffer[index];
+        for (int bitMask = 1 << 7; bitMask != 0; bitMask >>= 1)
+        {
+            int hiBit = crc & 0x8000;
+            crc = crc << 1 & 0xffff;
+            if (!hiBit != !(data & bitMask))
+            crc ^= 0x8005;
+        }
+
+        if (index != 3)
+        {
+            ++index;
+            if (index == size) break;
+        }
+        else
+        index = 6;
+    }
+    crc &= 0xffff;
+    return crc;
+}
+
+void fillRandomly(uint8_t buffer[], size_t size)
+{
+    for (size_t index = 0; index < size; ++index)
+        buffer[index] = static_cast<uint8_t>(rand());
+}
+
+TEST_CASE("calculateCRC", "[calculateCRC]")
+{
+    uint8_t buffer[38] = { };
+    for (int size = 7; size <= 38; ++size)
+    {
+        REQUIRE(
+            calculateCRC(size, buffer) == calculateCRCBitwise(size, buffer)
+            );
+    }
+
+    srand(1);
+    for (int round = 0; round < 1000; ++round)
+    {
+        fillRandomly(buffer, sizeof buffer);
+        for (int size = 7; size <= 38; ++size)
+        {
+            REQUIRE(
+                calculateCRC(size, buffer) ==
+                calculateCRCBitwise(size, buffer)
+                );
+        }
+    }
+}
+
+TEST_CASE("calculateCRCDelta", "[calculateCRC]")
+{
+    uint8_t buffer[38];
+    srand(2);
+    for (int round = 0; round < 1000; ++round)
+    {
+        fillRandomly(buffer, sizeof buffer);
+        int headerDelta = rand() & 0xffff;
+        for (int size = 7; size <= 38; ++size)
+        {
+            uint8_t changedBuffer[38];
+            memcpy(changedBuffer, buffer, sizeof buffer);
+            changedBuffer[2] ^= static_cast<uint8_t>(headerDelta >> 8);
+            changedBuffer[3] ^= static_cast<uint8_t>(headerDelta);
+            REQUIRE(
+                calculateCRC(size, changedBuffer) ==
+                (calculateCRC(size, buffer) ^
+                calculateCRCDelta(size, headerDelta))
+                );
+        }
+    }
+}
+
+// Hidden test case, run with the tag [benchmark].
+TEST_CASE("calculateCRC/benchmark", "[calculateCRC][benchmark][.]")
+{
+    typedef chrono::high_resolution_clock Clock;
+    const int bufferCount = 1024;
+    const int roundCount = 1000;
+    static uint8_t buffers[bufferCount][38];
+    for (auto & buffer: buffers) fillRandomly(buffer, sizeof buffer);
+
+    auto measure =
+        []
+        (int (* calculate)(int size, const uint8_t buffer[]),
+        unsigned int & result)
+        {
+            unsigned int crcSum = 0;
+            Clock::time_point start = Clock::now();
+            for (int round = 0; round < roundCount; ++round)
+                for (int index = 0; index < bufferCount; ++index)
+                {
+                    int size = 15 + (index + round) % 24;
+                    crcSum += calculate(size, buffers[index]);
+                }
+            Clock::duration duration = Clock::now() - start;
+            result = crcSum;
+            return
+                chrono::duration_cast<chrono::nanoseconds>(duration).count() /
+                static_cast<double>(roundCount * bufferCount);
+        };
+
+    unsigned int bitwiseResult, tableResult;
+    double bitwiseTime = measure(calculateCRCBitwise, bitwiseResult);
+    double tableTime = measure(calculateCRC, tableResult);
+    REQUIRE(bitwiseResult == tableResult);
+    cout <<
+        "calculateCRC: bitwise " << bitwiseTime << " ns, table-driven " <<
+        tableTime << " ns per frame" << endl;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MemoryMappedFile
+
+TEST_CASE("MemoryMappedFile", "[MemoryMappedFile]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("mapped"));
+    {
+        ofstream stream(filePath.c_str(), ios_base::binary);
+        stream << "MP3epoc";
+    }
+    {
+        MemoryMappedFile mappedFile(filePath, false);
+        REQUIRE(mappedFile.getData() != nullptr);
+        REQUIRE(mappedFile.getSize() == 7);
+        REQUIRE(memcmp(mappedFile.getData(), "MP3epoc", 7) == 0);
+    }
+    {
+        MemoryMappedFile mappedFile(filePath, true);
+        REQUIRE(mappedFile.getData() != nullptr);
+        mappedFile.getData()[0] = 'm';
+    }
+    {
+        char data[8] = { };
+        ifstream(filePath.c_str(), ios_base::binary).read(data, 7);
+        REQUIRE(strcmp(data, "mP3epoc") == 0);
+    }
+
+    filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("empty"));
+    ofstream(filePath.c_str()).close();
+    {
+        MemoryMappedFile mappedFile(filePath, false);
+        REQUIRE(mappedFile.getData() == nullptr);
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // fixNewlines
 
@@ -454,6 +913,1052 @@ TEST_CASE("fixNewlines", "[fixNewlines]")
 
 #endif // #ifdef _WIN32
 
+////////////////////////////////////////////////////////////////////////////////
+// MP3FrameHeader
+
+TEST_CASE("MP3FrameHeader/sizes", "[MP3FrameHeader]")
+{
+    // Every header with the sync bits set, i.e. 0xffe00000 to 0xffffffff.
+    uint32_t data = 0xffe00000;
+    do
+    {
+        const uint8_t buffer[] =
+        {
+            static_cast<uint8_t>(data >> 24),
+            static_cast<uint8_t>(data >> 16),
+            static_cast<uint8_t>(data >> 8),
+            static_cast<uint8_t>(data)
+        };
+        MP3FrameHeader header(buffer);
+        if (MP3FrameHeader::isValid(header))
+        {
+            size_t frameSize = header.getFrameSize();
+            int protectedSize = header.getProtectedSize();
+            if (
+                frameSize != header.calculateFrameSize() ||
+                protectedSize != header.calculateProtectedSize())
+            {
+                INFO("header: " << data);
+                REQUIRE(frameSize == header.calculateFrameSize());
+                REQUIRE(protectedSize == header.calculateProtectedSize());
+            }
+        }
+    }
+    while (++data != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3Stream
+
+TEST_CASE("MP3Stream/resync", "[MP3Stream]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("resync"));
+    // The first size puts a frame header across two blocks read in Stream
+    // mode.
+    const streamoff junkSizes[] = { 0xfffe, 100003 };
+    srand(3);
+    for (streamoff junkSize: junkSizes)
+    {
+        // Junk data with no valid frame headers, but some invalid ones.
+        vector<uint8_t> data(static_cast<size_t>(junkSize));
+        for (auto & byte: data)
+        {
+            byte = static_cast<uint8_t>(rand());
+            if (byte == 0xff) byte = 0;
+        }
+        for (size_t index = 7; index + 3 <= data.size(); index += 1001)
+        {
+            data[index] = 0xff;
+            data[index + 1] = 0xe0; // sync bits
+            data[index + 2] = 0xf0; // invalid bitrate
+        }
+        writeFile(filePath, data);
+        for (MP3ReadMode readMode: AllReadModes)
+        {
+            MP3Stream stream(filePath, ios_base::in, readMode);
+            REQUIRE(stream.resync(0) == -1);
+        }
+
+        // Append four frames.
+        {
+            vector<uint8_t> frames = makeFrames(4);
+            ofstream stream(
+                filePath.c_str(),
+                ios_base::binary | ios_base::app
+                );
+            stream.write(
+                reinterpret_cast<const char *>(frames.data()),
+                frames.size()
+                );
+        }
+        for (MP3ReadMode readMode: AllReadModes)
+        {
+            MP3Stream stream(filePath, ios_base::in, readMode);
+            REQUIRE(stream.resync(0) == junkSize);
+            REQUIRE(stream.resync(junkSize) == junkSize);
+        }
+    }
+}
+
+TEST_CASE("MP3Stream/windowed", "[MP3Stream]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("window"));
+    vector<uint8_t> data(1000);
+    for (size_t index = 0; index < data.size(); ++index)
+        data[index] = static_cast<uint8_t>(index * 7 % 251);
+    writeFile(filePath, data);
+
+    // With a window of 0x100 bytes, the reads cross the window boundaries, go
+    // back to the start, and reach the end of the file.
+    MP3Stream stream(filePath, ios_base::in, MP3ReadMode::Windowed, 0x100);
+    REQUIRE(stream.getReadMode() == MP3ReadMode::Windowed);
+    const streamoff offsets[] = { 0, 250, 300, 600, 10, 952, 980, 996 };
+    for (streamoff offset: offsets)
+    {
+        size_t count = min<size_t>(sizeof stream.buffer, 1000 - offset);
+        INFO("offset: " << offset);
+        REQUIRE(stream.readBuffer(offset, count));
+        REQUIRE(equal(stream.buffer, stream.buffer + count, &data[offset]));
+    }
+    REQUIRE(!stream.readBuffer(997, 4));
+    REQUIRE(!stream.readBuffer(1000, 1));
+
+    // A file that cannot be mapped, such as an empty one, is read in Windowed
+    // mode instead.
+    ofstream(filePath.c_str(), ios_base::binary).close();
+    MP3Stream emptyStream(filePath, ios_base::in, MP3ReadMode::MemoryMapped);
+    REQUIRE(emptyStream.getReadMode() == MP3ReadMode::Windowed);
+    REQUIRE(!emptyStream.readBuffer(0, 4));
+}
+
+TEST_CASE("MP3Stream/patches", "[MP3Stream]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("patches"));
+    vector<uint8_t> data(0x300000);
+    for (size_t index = 0; index < data.size(); ++index)
+        data[index] = static_cast<uint8_t>(index * 7 % 251);
+
+    auto patch =
+        [] (MP3Stream & stream, vector<uint8_t> & expectedData,
+        streamoff offset, size_t count)
+        {
+            for (size_t index = 0; index < count; ++index)
+            {
+                stream.buffer[index] =
+                    static_cast<uint8_t>(~expectedData[offset + index]);
+                expectedData[offset + index] = stream.buffer[index];
+            }
+            stream.patchBuffer(offset, count);
+        };
+
+    for (MP3ReadMode readMode: AllReadModes)
+    {
+        INFO("read mode: " << static_cast<int>(readMode));
+
+        // Patches separated by gaps just under and just over 16 KiB, given in
+        // no particular order, and a run of patches spanning more than 1 MiB.
+        writeFile(filePath, data);
+        vector<uint8_t> expectedData = data;
+        {
+            MP3Stream stream(
+                filePath,
+                ios_base::in | ios_base::out | ios_base::binary,
+                readMode
+                );
+            streamoff offset = 0x1000;
+            for (int index = 0; index < 4; ++index, offset += 6 + 0x3fff)
+                patch(stream, expectedData, offset, 6);
+            for (int index = 0; index < 4; ++index, offset += 6 + 0x4001)
+                patch(stream, expectedData, offset, 6);
+            patch(stream, expectedData, 0x20, 4);
+            for (offset = 0x100000; offset < 0x280000; offset += 0x2001)
+                patch(stream, expectedData, offset, 4);
+            stream.writePatches();
+        }
+        REQUIRE(readFile(filePath) == expectedData);
+
+        // Pending patches are written once there are too many of them, unless
+        // they are deferred.
+        writeFile(filePath, data);
+        expectedData = data;
+        {
+            MP3Stream stream(
+                filePath,
+                ios_base::in | ios_base::out | ios_base::binary,
+                readMode
+                );
+            vector<uint8_t> discardedData = data;
+            for (streamoff offset = 0; offset < 0x4000 * 64; offset += 64)
+                patch(stream, expectedData, offset, 2);
+            for (streamoff offset = 0x200000; offset < 0x200100; offset += 64)
+                patch(stream, discardedData, offset, 2);
+            stream.discardPatches();
+            stream.setPatchesDeferred(true);
+            for (streamoff offset = 0x300; offset < 0x4400 * 64; offset += 64)
+                patch(stream, discardedData, offset, 2);
+            stream.discardPatches();
+        }
+        REQUIRE(readFile(filePath) == expectedData);
+    }
+}
+
+TEST_CASE("MP3Stream/findTrailingData", "[MP3Stream]")
+{
+    xstring filePath =
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("trailingData"));
+    {
+        ofstream stream(filePath.c_str(), ios_base::binary);
+        stream << string(20000, 'x');
+        // A Lyrics3v1 tag followed by an ID3v1 tag. With the small window,
+        // the tags are not loaded at once in Windowed mode.
+        stream << "LYRICSBEGIN" << string(5000, 'L') << "LYRICSEND";
+        stream << "TAG" << string(125, '\0');
+    }
+    for (MP3ReadMode readMode: AllReadModes)
+    {
+        for (size_t windowSize: { 0x100, 0x100000 })
+        {
+            MP3Stream stream(filePath, ios_base::in, readMode, windowSize);
+            streamoff endOffset;
+            NonFramedDataFlags flags = stream.findTrailingData(0, endOffset);
+            REQUIRE(
+                flags ==
+                (NonFramedDataFlags::Lyrics3Tag | NonFramedDataFlags::ID3v1Tag)
+                );
+            REQUIRE(endOffset == 20000);
+            REQUIRE(stream.findTrailingData(20001, endOffset) == ID3v1Tag);
+        }
+    }
+
+    // In Piped mode, the input is read up to its end first.
+    {
+        ifstream input(filePath.c_str(), ios_base::binary);
+        MP3Stream stream(filePath, input, nullptr);
+        streamoff endOffset;
+        NonFramedDataFlags flags = stream.findTrailingData(0, endOffset);
+        REQUIRE(
+            flags ==
+            (NonFramedDataFlags::Lyrics3Tag | NonFramedDataFlags::ID3v1Tag)
+            );
+        REQUIRE(endOffset == 20000);
+        REQUIRE(stream.getSize() == 20000 + 5020 + 128);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3GearWheel
+
+TEST_CASE("MP3GearWheel/applyAttributes", "[MP3GearWheel]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("apply"));
+    vector<uint8_t> data = makeProtectedFrames(4);
+    MP3GearWheel gearWheel(
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::Set
+        )
+        );
+
+    for (MP3ReadMode readMode: AllReadModes)
+    {
+        gearWheel.setReadMode(readMode);
+
+        // A file failing the test is left untouched, even if the error is only
+        // found after the last frame.
+        vector<uint8_t> badData = data;
+        badData[3 * 417 + 5] ^= 0x01;
+        writeFile(filePath, badData);
+        REQUIRE_THROWS_AS(
+            gearWheel.applyAttributes(filePath),
+            MP3FrameCRCTestException
+            );
+        REQUIRE(readFile(filePath) == badData);
+
+        badData = data;
+        badData.insert(badData.end(), 200, 0x55);
+        writeFile(filePath, badData);
+        REQUIRE_THROWS_AS(
+            gearWheel.applyAttributes(filePath),
+            MP3DataUnknownException
+            );
+        REQUIRE(readFile(filePath) == badData);
+
+        // Otherwise every frame is changed, along with its CRC.
+        writeFile(filePath, data);
+        gearWheel.applyAttributes(filePath);
+        vector<uint8_t> changedData = readFile(filePath);
+        REQUIRE(changedData.size() == data.size());
+        for (size_t offset = 0; offset < data.size(); offset += 417)
+        {
+            REQUIRE((changedData[offset + 2] ^ data[offset + 2]) == 0x01);
+            REQUIRE(
+                calculateCRC(38, changedData.data() + offset) ==
+                (changedData[offset + 4] << 8 | changedData[offset + 5])
+                );
+        }
+    }
+}
+
+TEST_CASE("MP3GearWheel/buffer", "[MP3GearWheel]")
+{
+    // Four frames protected by a CRC, followed by an ID3v1 tag.
+    vector<uint8_t> data = makeProtectedFrames(4);
+    const char tag[] = "TAG";
+    data.insert(data.end(), tag, tag + 3);
+    data.resize(data.size() + 125);
+
+    MP3GearWheel gearWheel(
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::Set
+        )
+        );
+
+    // The data is processed like a file, and only changed when attributes
+    // are applied and the test has passed.
+    vector<uint8_t> originalData = data;
+    REQUIRE(
+        gearWheel.readAttributes(data.data(), data.size(), true)
+        .toString(false) == XSTR("-P* -C* -O* E0*")
+        );
+    REQUIRE(data == originalData);
+
+    data[2 * 417 + 5] ^= 0x01;
+    vector<uint8_t> badData = data;
+    REQUIRE_THROWS_AS(
+        gearWheel.applyAttributes(data.data(), data.size()),
+        MP3FrameCRCTestException
+        );
+    REQUIRE(data == badData);
+
+    data = originalData;
+    gearWheel.applyAttributes(data.data(), data.size());
+    REQUIRE(
+        gearWheel.readAttributes(data.data(), data.size(), true)
+        .toString(false) == XSTR("+P* -C* -O* E0*")
+        );
+    REQUIRE(equal(data.end() - 128, data.end(), originalData.end() - 128));
+}
+
+TEST_CASE("MP3GearWheel/stream", "[MP3GearWheel]")
+{
+    // 400 frames protected by a CRC, between an ID3v2 tag and an ID3v1 tag,
+    // so that the input is read in several blocks.
+    vector<uint8_t> frames = makeProtectedFrames(400);
+    string data("ID3\x03\0\0\0\0\0\x10", 10);
+    data.append(16, '\0');
+    data.append(frames.begin(), frames.end());
+    data.append("TAG").append(125, '\0');
+
+    MP3GearWheel gearWheel(
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::Set
+        )
+        );
+
+    // The output is the same as the data processed in place.
+    vector<uint8_t> expectedData(data.begin(), data.end());
+    gearWheel.applyAttributes(expectedData.data(), expectedData.size());
+    string outputData;
+    {
+        istringstream input(data);
+        ostringstream output;
+        REQUIRE(
+            gearWheel.applyAttributes(input, output, XSTR("-"))
+            .toString(false) == XSTR("-P* -C* -O* E0*")
+            );
+        outputData = output.str();
+    }
+    REQUIRE(
+        vector<uint8_t>(outputData.begin(), outputData.end()) == expectedData
+        );
+    {
+        istringstream input(outputData);
+        REQUIRE(
+            gearWheel.readAttributes(input, XSTR("-")).toString(false) ==
+            XSTR("+P* -C* -O* E0*")
+            );
+    }
+
+    // Unknown data after the frames is only found once the input has been
+    // read up to its end.
+    data.resize(data.size() - 128);
+    data.append(200, 'x');
+    {
+        istringstream input(data);
+        ostringstream output;
+        REQUIRE_THROWS_AS(
+            gearWheel.applyAttributes(input, output, XSTR("-")),
+            MP3DataUnknownException
+            );
+    }
+}
+
+TEST_CASE("MP3GearWheel/batch", "[MP3GearWheel]")
+{
+    // Four frames protected by a CRC, followed by an ID3v1 tag, by unknown
+    // data, or by nothing.
+    vector<uint8_t> data = makeProtectedFrames(4);
+    vector<uint8_t> taggedData = data;
+    const char tag[] = "TAG";
+    taggedData.insert(taggedData.end(), tag, tag + 3);
+    taggedData.resize(taggedData.size() + 125);
+    vector<uint8_t> badData = data;
+    badData.insert(badData.end(), 200, 0x55);
+
+    vector<xstring> filePaths;
+    auto addFile =
+        [&filePaths] (xstring fileName, const vector<uint8_t> & fileData)
+        {
+            xstring filePath =
+                xstring(tempDir).append(DIR_SEPARATOR).append(fileName);
+            writeFile(filePath, fileData);
+            filePaths.push_back(filePath);
+        };
+    for (int index = 0; index < 3; ++index)
+    {
+        xchar digit = static_cast<xchar>(XSTR('0') + index);
+        addFile(xstring(XSTR("batchTagged")).append(1, digit), taggedData);
+        addFile(xstring(XSTR("batchBad")).append(1, digit), badData);
+        addFile(xstring(XSTR("batch")).append(1, digit), data);
+    }
+    filePaths.push_back(
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("batchMissing"))
+        );
+
+    MP3GearWheel gearWheel(
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::Set
+        )
+        );
+
+    // The results are in the order of the paths, whatever the number of
+    // threads, and every error is kept with its file.
+    const unsigned int threadCounts[] = { 0, 1, 4 };
+    for (unsigned int threadCount: threadCounts)
+    {
+        vector<MP3FileResult> fileResults =
+            gearWheel.readAttributes(filePaths, threadCount);
+        REQUIRE(fileResults.size() == filePaths.size());
+        for (size_t index = 0; index < 9; index += 3)
+        {
+            REQUIRE(!fileResults[index].exception);
+            REQUIRE(
+                fileResults[index].attributeSet.toString(false) ==
+                XSTR("-P* -C* -O* E0*")
+                );
+            REQUIRE(
+                fileResults[index].nonFramedDataFlags ==
+                NonFramedDataFlags::ID3v1Tag
+                );
+            REQUIRE_THROWS_AS(
+                rethrow_exception(fileResults[index + 1].exception),
+                MP3DataUnknownException
+                );
+            REQUIRE(!fileResults[index + 2].exception);
+            REQUIRE(
+                fileResults[index + 2].nonFramedDataFlags ==
+                NonFramedDataFlags::None
+                );
+        }
+        REQUIRE_THROWS_AS(
+            rethrow_exception(fileResults[9].exception),
+            MP3GenericException
+            );
+    }
+
+    filePaths.erase(filePaths.begin() + 3, filePaths.end());
+    vector<MP3FileResult> fileResults =
+        gearWheel.applyAttributes(filePaths, 2);
+    REQUIRE(!fileResults[0].exception);
+    REQUIRE(
+        fileResults[0].attributeSet.toString(false) == XSTR("-P* -C* -O* E0*")
+        );
+    REQUIRE(fileResults[1].exception);
+    REQUIRE(
+        gearWheel.readAttributes(filePaths[0]).toString(false) ==
+        XSTR("+P* -C* -O* E0*")
+        );
+
+    // The gear wheels used on the threads keep the behavior of a subclass.
+    class FailingGearWheel: public MP3GearWheel
+    {
+    public:
+        virtual unique_ptr<MP3GearWheel> clone() const override
+        {
+            return unique_ptr<MP3GearWheel>(new FailingGearWheel(*this));
+        }
+    protected:
+        virtual MP3AttributeSet
+            internalApplyAttributes(
+            const xstring & filePath,
+            MP3AttributeSet,
+            bool) override
+        {
+            throw MP3GenericException(filePath);
+        }
+    };
+
+    fileResults = FailingGearWheel().readAttributes(filePaths, 2);
+    for (const MP3FileResult & fileResult: fileResults)
+        REQUIRE(fileResult.exception);
+}
+
+TEST_CASE("MP3GearWheel/earlyExit", "[MP3GearWheel]")
+{
+    xstring filePath =
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("earlyExit"));
+
+    // Frames of MPEG1 Layer III, 128 kbps, 44100 Hz, followed by junk data.
+    // Every attribute of the second frame differs from the first frame.
+    auto writeFrames =
+        [&filePath] (uint8_t secondHeader2, uint8_t secondHeader3)
+        {
+            vector<uint8_t> data = makeFrames(4);
+            data[417 + 2] |= secondHeader2;
+            data[417 + 3] |= secondHeader3;
+            data.insert(data.end(), 200, 0x55);
+            writeFile(filePath, data);
+        };
+
+    MP3GearWheel gearWheel;
+    writeFrames(0x01, 0x0d);
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, true),
+        MP3DataUnknownException
+        );
+
+    // The result is settled after the second frame.
+    gearWheel.setEarlyExit(true);
+    MP3AttributeSet attributeSet = gearWheel.readAttributes(filePath, true);
+    REQUIRE(!attributeSet.isWholeFile());
+    REQUIRE(
+        attributeSet.private_().getStatus() == BinaryAttributeStatus::NotSet
+        );
+
+    // The result is not settled until the end of the frames.
+    writeFrames(0x01, 0x00);
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, true),
+        MP3DataUnknownException
+        );
+
+    // Unless it cannot match the expected result.
+    MP3AttributeSet attributeSetToMatch =
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::NotSet
+        );
+    gearWheel.setAttributeSetToMatch(attributeSetToMatch);
+    REQUIRE(
+        !gearWheel.readAttributes(filePath, true).matches(attributeSetToMatch)
+        );
+}
+
+TEST_CASE("MP3GearWheel/repeatedFrames", "[MP3GearWheel]")
+{
+    xstring filePath =
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("repeated"));
+
+    // Frames of MPEG1 Layer III, 128 kbps, 44100 Hz, every third one padded.
+    // Only the private bit of one frame in the middle differs.
+    vector<uint8_t> data;
+    vector<uint16_t> frameSizes;
+    for (int frameNumber = 1; frameNumber <= 400; ++frameNumber)
+    {
+        size_t offset = data.size();
+        bool padded = frameNumber % 3 == 0;
+        data.resize(offset + (padded ? 418 : 417));
+        data[offset] = 0xff;
+        data[offset + 1] = 0xfb;
+        data[offset + 2] = padded ? 0x92 : 0x90;
+        if (frameNumber == 250) data[offset + 2] |= 0x01;
+        frameSizes.push_back(padded ? 418 : 417);
+    }
+    writeFile(filePath, data);
+
+    shared_ptr<MP3FrameIndexCache> cache =
+        make_shared<MP3FrameIndexCache>(
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("index") DIR_SEPARATOR)
+        .append(XSTR("repeated"))
+        );
+    MP3GearWheel gearWheel;
+    gearWheel.setFrameIndexCache(cache);
+    for (MP3ReadMode readMode: AllReadModes)
+    {
+        gearWheel.setReadMode(readMode);
+
+        // The differing frame is found among the repeated ones, and every
+        // frame is counted.
+        MP3AttributeSet attributeSet = gearWheel.readAttributes(filePath, true);
+        REQUIRE(attributeSet.copyright_().isWholeFile());
+        REQUIRE(!attributeSet.private_().isWholeFile());
+        MP3FrameIndex index;
+        REQUIRE(cache->load(filePath, index));
+        REQUIRE(index.frameSizes == frameSizes);
+    }
+}
+
+TEST_CASE("MP3GearWheel/locateKeyFrame", "[MP3GearWheel]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("locate"));
+
+    // 1000 frames of MPEG1 Layer III, 128 kbps, 44100 Hz, whose mean size is
+    // 20480 / 49 bytes. The header of frame 300 is damaged, so that the key
+    // frame cannot be reached by walking the frames. Only the frames around
+    // the key frame, and the first frame, whose header the frames found by
+    // estimating their offset must share, are copyrighted.
+    vector<uint8_t> data;
+    vector<uint16_t> frameSizes;
+    for (int index = 0; index < 1000; ++index)
+    {
+        size_t size = (index + 1) * 20480 / 49 - index * 20480 / 49;
+        size_t offset = data.size();
+        data.resize(offset + size);
+        data[offset] = 0xff;
+        data[offset + 1] = 0xfb;
+        data[offset + 2] = size == 418 ? 0x92 : 0x90;
+        data[offset + 3] = index == 0 || abs(index - 699) <= 5 ? 0x08 : 0x00;
+        frameSizes.push_back(static_cast<uint16_t>(size));
+    }
+    data[accumulate(frameSizes.begin(), frameSizes.begin() + 299, 0)] = 0;
+
+    MP3GearWheel gearWheel;
+    gearWheel.setKeyFrameNumber(700);
+    auto isKeyFrameLocated =
+        [&gearWheel, &filePath] ()
+        {
+            return
+                gearWheel.readAttributes(filePath, false).copyright_()
+                .getStatus() == BinaryAttributeStatus::Set;
+        };
+
+    // Without a header confirming it, a constant bitrate is only assumed if
+    // key frames may be approximate.
+    writeFile(filePath, data);
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, true),
+        MP3DataUnknownException
+        );
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, false),
+        MP3DataUnknownException
+        );
+    gearWheel.setKeyFrameApproximate(true);
+    REQUIRE(isKeyFrameLocated());
+    gearWheel.setKeyFrameApproximate(false);
+
+    // The key frame of a file whose Info header counts frames of the mean size
+    // is found right away.
+    vector<uint8_t> xingFrame(417);
+    const uint8_t xingData[] =
+    {
+        0xff, 0xfb, 0x90, 0x00, 'I', 'n', 'f', 'o', 0, 0, 0, 0x03,
+        0, 0, 0x03, 0xe8 // 1000 frames
+    };
+    memcpy(xingFrame.data(), xingData, 4);
+    memcpy(xingFrame.data() + 36, xingData + 4, sizeof xingData - 4);
+    uint32_t byteCount = static_cast<uint32_t>(417 + data.size());
+    for (int index = 0; index < 4; ++index)
+        xingFrame[48 + index] =
+        static_cast<uint8_t>(byteCount >> (24 - 8 * index));
+    {
+        vector<uint8_t> infoData(xingFrame);
+        infoData.insert(infoData.end(), data.begin(), data.end());
+        writeFile(filePath, infoData);
+        REQUIRE(isKeyFrameLocated());
+
+        // Not if any frame is missing.
+        infoData.resize(infoData.size() - frameSizes.back());
+        writeFile(filePath, infoData);
+        REQUIRE_THROWS_AS(
+            gearWheel.readAttributes(filePath, false),
+            MP3DataUnknownException
+            );
+    }
+
+    // A Xing header marks a file with a variable bitrate.
+    memcpy(xingFrame.data() + 36, "Xing", 4);
+    xingFrame[36 + 7] = 0x07;
+    for (int index = 0; index < 100; ++index)
+    {
+        size_t offset =
+            417 +
+            accumulate(
+            frameSizes.begin(),
+            frameSizes.begin() + index * 10,
+            size_t(0)
+            );
+        xingFrame[52 + index] =
+            static_cast<uint8_t>(offset * 256 / byteCount);
+    }
+    data.insert(data.begin(), xingFrame.begin(), xingFrame.end());
+    writeFile(filePath, data);
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, false),
+        MP3DataUnknownException
+        );
+
+    // Its table of contents only leads near the key frame.
+    gearWheel.setKeyFrameApproximate(true);
+    REQUIRE(isKeyFrameLocated());
+    gearWheel.setKeyFrameApproximate(false);
+
+    // A cached frame index leads to the key frame itself.
+    shared_ptr<MP3FrameIndexCache> cache =
+        make_shared<MP3FrameIndexCache>(
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("index") DIR_SEPARATOR)
+        .append(XSTR("locate"))
+        );
+    MP3FrameIndex index;
+    index.startOffset = 0;
+    index.endOffset = static_cast<streamoff>(data.size());
+    index.nonFramedDataFlags = NonFramedDataFlags::None;
+    index.frameSizes = frameSizes;
+    index.frameSizes.insert(index.frameSizes.begin(), 417);
+    cache->store(filePath, index);
+    gearWheel.setFrameIndexCache(cache);
+    REQUIRE(isKeyFrameLocated());
+}
+
+TEST_CASE("MP3GearWheel/readVBRHeader", "[MP3GearWheel]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("vbr"));
+
+    // A Xing header with a frame count, a byte count and a table of contents,
+    // followed by ten frames of MPEG1 Layer III, 128 kbps, 44100 Hz.
+    auto writeFrames =
+        [&filePath] (uint32_t byteCount)
+        {
+            vector<uint8_t> data = makeFrames(11);
+            const uint8_t xingData[] =
+            {
+                'X', 'i', 'n', 'g', 0, 0, 0, 0x07, 0, 0, 0, 10,
+                static_cast<uint8_t>(byteCount >> 24),
+                static_cast<uint8_t>(byteCount >> 16),
+                static_cast<uint8_t>(byteCount >> 8),
+                static_cast<uint8_t>(byteCount)
+            };
+            memcpy(data.data() + 36, xingData, sizeof xingData);
+            for (size_t index = 0; index < 100; ++index)
+                data[36 + sizeof xingData + index] =
+                static_cast<uint8_t>(index * 256 / 100);
+            writeFile(filePath, data);
+        };
+
+    MP3GearWheel gearWheel;
+    MP3VBRHeader vbrHeader;
+    writeFrames(11 * 417);
+    REQUIRE(gearWheel.readVBRHeader(filePath, vbrHeader));
+    REQUIRE(vbrHeader.type == MP3VBRHeader::Type::Xing);
+    REQUIRE(vbrHeader.frameCount == 10);
+    REQUIRE(vbrHeader.byteCount == 11 * 417);
+    REQUIRE(vbrHeader.seekPoints.size() == 100);
+    REQUIRE(vbrHeader.seekPoints[50].frameCount == 5);
+    REQUIRE(vbrHeader.seekPoints[50].offset == 11 * 417 * 128 / 256);
+
+    // The header frame may or may not be included in the byte count.
+    writeFrames(10 * 417);
+    REQUIRE(gearWheel.readVBRHeader(filePath, vbrHeader));
+
+    // But a file that was cut does not match its header any more.
+    writeFrames(12 * 417);
+    REQUIRE(!gearWheel.readVBRHeader(filePath, vbrHeader));
+
+    // A VBRI header with two entries of five frames each, with a size of 2
+    // bytes and a scale of 1.
+    vector<uint8_t> data = makeFrames(11);
+    const uint8_t vbriData[] =
+    {
+        'V', 'B', 'R', 'I', 0, 1, 0, 0, 0, 0x4b,
+        0, 0, 0x11, 0xeb, // 4587 bytes
+        0, 0, 0, 10, // 10 frames
+        0, 2, 0, 1, 0, 2, 0, 5,
+        0x08, 0x25, 0x08, 0x25
+    };
+    memcpy(data.data() + 36, vbriData, sizeof vbriData);
+    writeFile(filePath, data);
+    REQUIRE(gearWheel.readVBRHeader(filePath, vbrHeader));
+    REQUIRE(vbrHeader.type == MP3VBRHeader::Type::VBRI);
+    REQUIRE(vbrHeader.frameCount == 10);
+    REQUIRE(vbrHeader.byteCount == 11 * 417);
+
+    // The last entry reaches the end of the frames.
+    REQUIRE(vbrHeader.seekPoints.size() == 1);
+    REQUIRE(vbrHeader.seekPoints[0].frameCount == 5);
+    REQUIRE(vbrHeader.seekPoints[0].offset == 417 + 5 * 417);
+}
+
+TEST_CASE("MP3GearWheel/sampleAttributes", "[MP3GearWheel]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("sample"));
+
+    // Frames of MPEG1 Layer III, 128 kbps, 48000 Hz, every other frame with
+    // the private bit set from frameNumber on.
+    auto writeFrames =
+        [&filePath] (int frameCount, int frameNumber)
+        {
+            vector<uint8_t> data = makeFrames(frameCount, 0xfffb9400);
+            for (int index = 0; index < frameCount; ++index)
+                if (index + 1 >= frameNumber && index % 2 != 0)
+                    data[index * 384 + 2] |= 0x01;
+            writeFile(filePath, data);
+        };
+
+    MP3GearWheel gearWheel;
+    double sampledShare;
+    REQUIRE_THROWS_AS(
+        gearWheel.sampleAttributes(filePath, 0, sampledShare),
+        invalid_argument
+        );
+
+    // Only a small share of a large file is read.
+    writeFrames(10000, 10001);
+    MP3AttributeSet attributeSet =
+        gearWheel.sampleAttributes(filePath, 16, sampledShare);
+    REQUIRE(attributeSet.toString(false) == XSTR("-P* -C* -O* E0*"));
+    REQUIRE(sampledShare > 0.005);
+    REQUIRE(sampledShare < 0.01);
+
+    // Frames that differ from the key frame are likely to be found.
+    writeFrames(10000, 5000);
+    attributeSet = gearWheel.sampleAttributes(filePath, 16, sampledShare);
+    REQUIRE(attributeSet.toString(false) == XSTR("-P  -C* -O* E0*"));
+
+    // A small file is read in whole.
+    writeFrames(20, 20);
+    attributeSet = gearWheel.sampleAttributes(filePath, 16, sampledShare);
+    REQUIRE(attributeSet.toString(false) == XSTR("-P  -C* -O* E0*"));
+    REQUIRE(sampledShare == 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3VBRHeader
+
+TEST_CASE("MP3VBRHeader", "[MP3VBRHeader]")
+{
+    // A frame of MPEG1 Layer III, 128 kbps, 44100 Hz.
+    vector<uint8_t> frame(417);
+    frame[0] = 0xff;
+    frame[1] = 0xfb;
+    frame[2] = 0x90;
+    MP3VBRHeader vbrHeader;
+    REQUIRE(!MP3VBRHeader::parse(frame.data(), frame.size(), vbrHeader));
+
+    SECTION("Xing")
+    {
+        // In mono, the side information is only 17 bytes long.
+        frame[3] = 0xc0;
+        const uint8_t xingData[] =
+        {
+            'I', 'n', 'f', 'o', 0, 0, 0, 0x07,
+            0, 0, 0x03, 0xe8, // 1000 frames
+            0, 0x06, 0x5e, 0x89 // 417417 bytes
+        };
+        memcpy(frame.data() + 21, xingData, sizeof xingData);
+        for (size_t index = 0; index < 100; ++index)
+            frame[21 + sizeof xingData + index] =
+            static_cast<uint8_t>(index * 256 / 100);
+        REQUIRE(MP3VBRHeader::parse(frame.data(), frame.size(), vbrHeader));
+        REQUIRE(vbrHeader.type == MP3VBRHeader::Type::Info);
+        REQUIRE(vbrHeader.frameCount == 1000);
+        REQUIRE(vbrHeader.byteCount == 417417);
+        REQUIRE(vbrHeader.seekPoints.size() == 100);
+        REQUIRE(vbrHeader.seekPoints[50].frameCount == 500);
+        REQUIRE(vbrHeader.seekPoints[50].offset == 417417 * 128 / 256);
+
+        // A truncated header is invalid.
+        REQUIRE(!MP3VBRHeader::parse(frame.data(), 100, vbrHeader));
+        REQUIRE(vbrHeader.type == MP3VBRHeader::Type::Info);
+    }
+
+    SECTION("VBRI")
+    {
+        // Four entries of 250 frames each, with a size of 2 bytes and a
+        // scale of 2.
+        const uint8_t vbriData[] =
+        {
+            'V', 'B', 'R', 'I', 0, 1, 0, 0, 0, 0x4b,
+            0, 0x06, 0x5e, 0x89, // 417417 bytes
+            0, 0, 0x03, 0xe8, // 1000 frames
+            0, 4, 0, 2, 0, 2, 0, 250,
+            0xcb, 0x9d, 0xcb, 0x9d, 0xcb, 0x9d, 0xcb, 0x9d
+        };
+        memcpy(frame.data() + 36, vbriData, sizeof vbriData);
+        REQUIRE(MP3VBRHeader::parse(frame.data(), frame.size(), vbrHeader));
+        REQUIRE(vbrHeader.type == MP3VBRHeader::Type::VBRI);
+        REQUIRE(vbrHeader.frameCount == 1000);
+        REQUIRE(vbrHeader.byteCount == 417417);
+
+        // The last entry reaches the end of the frames.
+        REQUIRE(vbrHeader.seekPoints.size() == 3);
+        REQUIRE(vbrHeader.seekPoints[0].frameCount == 250);
+        REQUIRE(vbrHeader.seekPoints[0].offset == 417 + 250 * 417);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3FrameIndexCache
+
+TEST_CASE("MP3FrameIndexCache", "[MP3FrameIndexCache]")
+{
+    xstring filePath = xstring(tempDir).append(DIR_SEPARATOR XSTR("indexed"));
+    {
+        // Four MPEG1 Layer III frames followed by an ID3v1 tag.
+        vector<uint8_t> data = makeFrames(4);
+        const char tag[] = "TAG";
+        data.insert(data.end(), tag, tag + 3);
+        data.resize(data.size() + 125);
+        writeFile(filePath, data);
+    }
+    shared_ptr<MP3FrameIndexCache> cache =
+        make_shared<MP3FrameIndexCache>(
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("index") DIR_SEPARATOR)
+        .append(XSTR("frames"))
+        );
+    MP3FrameIndex index;
+    REQUIRE(!cache->load(filePath, index));
+
+    // Reading the whole file stores its index.
+    MP3GearWheel gearWheel;
+    gearWheel.setFrameIndexCache(cache);
+    MP3AttributeSet attributeSet = gearWheel.readAttributes(filePath, true);
+    REQUIRE(cache->load(filePath, index));
+    REQUIRE(index.startOffset == 0);
+    REQUIRE(index.endOffset == 4 * 417);
+    REQUIRE(index.nonFramedDataFlags == NonFramedDataFlags::ID3v1Tag);
+    REQUIRE(index.frameSizes == vector<uint16_t>(4, 417));
+
+    // The stored index is used instead of looking for tags.
+    MP3FrameIndex wrongIndex = index;
+    wrongIndex.endOffset += 128;
+    cache->store(filePath, wrongIndex);
+    REQUIRE_THROWS_AS(
+        gearWheel.readAttributes(filePath, true),
+        MP3DataUnknownException
+        );
+
+    // An index with different frames is ignored.
+    wrongIndex = index;
+    wrongIndex.frameSizes.pop_back();
+    cache->store(filePath, wrongIndex);
+    REQUIRE(
+        gearWheel.readAttributes(filePath, true).toString(false) ==
+        attributeSet.toString(false)
+        );
+    REQUIRE(cache->load(filePath, index));
+    REQUIRE(index.frameSizes == vector<uint16_t>(4, 417));
+
+    // Changing the file updates the index.
+    gearWheel.setAttributeSetToApply(
+        makeWholeFileAttributeSet(
+        MP3Attribute::Private,
+        BinaryAttributeStatus::Set
+        )
+        );
+    gearWheel.applyAttributes(filePath);
+    REQUIRE(cache->load(filePath, index));
+    REQUIRE(index.frameSizes == vector<uint16_t>(4, 417));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// MP3ResultCache
+
+TEST_CASE("MP3ResultCache", "[MP3ResultCache]")
+{
+    xstring cacheFilePath =
+        xstring(tempDir).append(DIR_SEPARATOR XSTR("results"));
+    MP3AttributeSet attributeSet;
+    attributeSet.initAttributeStatus(
+        MP3Attribute::Copyright,
+        static_cast<int>(BinaryAttributeStatus::Set)
+        );
+    MP3AttributeSet loadedAttributeSet;
+    NonFramedDataFlags loadedFlags;
+    FileIdentity identity = { 1, 0, 1000, 2000 };
+    {
+        MP3ResultCache cache(cacheFilePath);
+
+        // Enough results to make the table grow several times.
+        for (
+            identity.fileNumber = 0;
+            identity.fileNumber < 20000;
+            ++identity.fileNumber)
+        {
+            REQUIRE(!cache.load(identity, 5, loadedAttributeSet, loadedFlags));
+            cache.store(identity, 5, attributeSet, NonFramedDataFlags::ApeTag);
+        }
+        identity.fileNumber = 12345;
+        REQUIRE(cache.load(identity, 5, loadedAttributeSet, loadedFlags));
+        REQUIRE(
+            loadedAttributeSet.toString(false) == attributeSet.toString(false)
+            );
+        REQUIRE(loadedFlags == NonFramedDataFlags::ApeTag);
+
+        // Results are only valid for unchanged files read the same way.
+        REQUIRE(!cache.load(identity, 6, loadedAttributeSet, loadedFlags));
+        ++identity.modificationTime;
+        REQUIRE(!cache.load(identity, 5, loadedAttributeSet, loadedFlags));
+        cache.store(identity, 5, MP3AttributeSet(), NonFramedDataFlags::None);
+        REQUIRE(cache.load(identity, 5, loadedAttributeSet, loadedFlags));
+        REQUIRE(loadedAttributeSet.isUnspecified());
+    }
+
+    // The results are kept in the file.
+    {
+        MP3ResultCache cache(cacheFilePath);
+        identity.modificationTime = 2000;
+        for (
+            identity.fileNumber = 0;
+            identity.fileNumber < 20000;
+            ++identity.fileNumber)
+        {
+            if (identity.fileNumber != 12345)
+            {
+                REQUIRE(
+                    cache.load(identity, 5, loadedAttributeSet, loadedFlags)
+                    );
+            }
+        }
+    }
+
+    // Growing the table does not take away the file another cache has mapped.
+    {
+        MP3ResultCache cache1(cacheFilePath);
+        MP3ResultCache cache2(cacheFilePath);
+        for (
+            identity.fileNumber = 20000;
+            identity.fileNumber < 40000;
+            ++identity.fileNumber)
+        {
+            cache1.store(identity, 5, attributeSet, NonFramedDataFlags::None);
+        }
+        for (
+            identity.fileNumber = 0;
+            identity.fileNumber < 20000;
+            identity.fileNumber += 1000)
+        {
+            REQUIRE(cache2.load(identity, 5, loadedAttributeSet, loadedFlags));
+        }
+    }
+
+    // A damaged file is replaced with an empty one.
+    {
+        ofstream stream(
+            cacheFilePath.c_str(),
+            ios_base::binary | ios_base::in | ios_base::out
+            );
+        stream.write("XX", 2);
+    }
+    {
+        MP3ResultCache cache(cacheFilePath);
+        identity.fileNumber = 0;
+        REQUIRE(!cache.load(identity, 5, loadedAttributeSet, loadedFlags));
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // processFile
 
@@ -478,7 +1983,13 @@ TEST_CASE("processFile", "[processFile]")
     MP3AttributeSet attributeSetToView;
     
     ProcessFileResult result =
-        processFile(XSTR(""), gearWheel, attributeSetToView, XSTR('\0'));
+        processFile(
+        XSTR(""),
+        gearWheel,
+        attributeSetToView,
+        false,
+        XSTR('\0')
+        );
 
     xcout.rdbuf(oldWriter);
     
@@ -495,6 +2006,266 @@ TEST_CASE("processFile", "[processFile]")
     REQUIRE(actual == expected);
 }
 
+static vector<xstring> getSortedLines(const xstring & text);
+
+vector<xstring> getSortedLines(const xstring & text)
+{
+    vector<xstring> lines;
+    xistringstream stream(text);
+    for (xstring line; getline(stream, line);) lines.push_back(line);
+    sort(lines.begin(), lines.end());
+    return lines;
+}
+
+TEST_CASE("processFiles", "[processFile]")
+{
+    // Files of MPEG1 Layer III frames with different attributes, and some
+    // invalid files.
+    vector<xstring> filePaths;
+    for (int index = 0; index < 40; ++index)
+    {
+        xostringstream fileName;
+        fileName << DIR_SEPARATOR XSTR("files") << index;
+        xstring filePath = xstring(tempDir).append(fileName.str());
+        ofstream stream(filePath.c_str(), ios_base::binary);
+        if (index % 7 != 3)
+        {
+            vector<uint8_t> frames = makeFrames(3);
+            for (size_t offset = 0; offset < frames.size(); offset += 417)
+                frames[offset + 3] = static_cast<uint8_t>(index & 0x0f);
+            stream.write(
+                reinterpret_cast<const char *>(frames.data()),
+                frames.size()
+                );
+        }
+        filePaths.push_back(filePath);
+    }
+
+    MP3GearWheel gearWheel;
+    gearWheel.setKeyFrameNumber(2);
+    MP3AttributeSet attributeSetToView;
+    xstring outputs[2];
+    int processedFileCounts[2] = { };
+    int modifiedFileCounts[2] = { };
+    int listedFileCounts[2] = { };
+    const unsigned int threadCounts[] = { 1, 4 };
+    for (int index = 0; index < 2; ++index)
+    {
+        xstringbuf newWriter;
+        xstreambuf * oldWriter = xcout.rdbuf();
+        xcout.rdbuf(&newWriter);
+        processFiles(
+            filePaths,
+            gearWheel,
+            attributeSetToView,
+            false,
+            XSTR('L'),
+            threadCounts[index],
+            processedFileCounts[index],
+            modifiedFileCounts[index],
+            listedFileCounts[index]
+            );
+        xcout.rdbuf(oldWriter);
+        outputs[index] = newWriter.str();
+    }
+    REQUIRE(outputs[1] == outputs[0]);
+    REQUIRE(processedFileCounts[0] == 34);
+    REQUIRE(processedFileCounts[1] == 34);
+    REQUIRE(modifiedFileCounts[0] == 0);
+    REQUIRE(modifiedFileCounts[1] == 0);
+    REQUIRE(listedFileCounts[0] == 34);
+    REQUIRE(listedFileCounts[1] == 34);
+
+    // Processing the files while they are being found gives the same output,
+    // in the same order if there is only one thread.
+    for (unsigned int threadCount: threadCounts)
+    {
+        int processedFileCount = 0;
+        int modifiedFileCount = 0;
+        int listedFileCount = 0;
+        xstringbuf newWriter;
+        xstreambuf * oldWriter = xcout.rdbuf();
+        xcout.rdbuf(&newWriter);
+        processFiles(
+            [&filePaths] (function<void (xstring &&)> addFilePath)
+            {
+                for (xstring filePath: filePaths) addFilePath(move(filePath));
+            },
+            gearWheel,
+            attributeSetToView,
+            false,
+            XSTR('L'),
+            threadCount,
+            processedFileCount,
+            modifiedFileCount,
+            listedFileCount
+            );
+        xcout.rdbuf(oldWriter);
+        xstring output = newWriter.str();
+        if (threadCount == 1)
+            REQUIRE(output == outputs[0]);
+        else
+            REQUIRE(getSortedLines(output) == getSortedLines(outputs[0]));
+        REQUIRE(processedFileCount == 34);
+        REQUIRE(modifiedFileCount == 0);
+        REQUIRE(listedFileCount == 34);
+    }
+
+    // Only the paths of the files selected are shown, and the files not
+    // matching are selected if the match is inverted.
+    vector<xstring> validFilePaths;
+    for (int index = 0; index < 40; ++index)
+        if (index % 7 != 3) validFilePaths.push_back(filePaths[index]);
+    MP3AttributeSet copyrightSet;
+    copyrightSet.initAttributeStatus(
+        MP3Attribute::Copyright,
+        static_cast<int>(BinaryAttributeStatus::Set)
+        );
+    for (bool invertMatch: { false, true })
+    {
+        int processedFileCount = 0;
+        int modifiedFileCount = 0;
+        int listedFileCount = 0;
+        xstringbuf newWriter;
+        xstreambuf * oldWriter = xcout.rdbuf();
+        xcout.rdbuf(&newWriter);
+        processFiles(
+            validFilePaths,
+            gearWheel,
+            copyrightSet,
+            invertMatch,
+            XSTR('N'),
+            4,
+            processedFileCount,
+            modifiedFileCount,
+            listedFileCount
+            );
+        xcout.rdbuf(oldWriter);
+        xostringstream expected;
+        int expectedListedFileCount = 0;
+        for (int index = 0; index < 40; ++index)
+        {
+            if (index % 7 != 3 && ((index & 0x08) != 0) != invertMatch)
+            {
+                expected << filePaths[index] << endl;
+                ++expectedListedFileCount;
+            }
+        }
+        REQUIRE(newWriter.str() == expected.str());
+        REQUIRE(processedFileCount == 34);
+        REQUIRE(listedFileCount == expectedListedFileCount);
+    }
+
+    // Errors in the search are thrown.
+    int processedFileCount = 0;
+    int modifiedFileCount = 0;
+    int listedFileCount = 0;
+    xstringbuf newWriter;
+    xstreambuf * oldWriter = xcout.rdbuf();
+    xcout.rdbuf(&newWriter);
+    REQUIRE_THROWS_AS(
+        processFiles(
+            [&filePaths] (function<void (xstring &&)> addFilePath)
+            {
+                addFilePath(xstring(filePaths[0]));
+                throw runtime_error("search failed");
+            },
+            gearWheel,
+            attributeSetToView,
+            false,
+            XSTR('L'),
+            4,
+            processedFileCount,
+            modifiedFileCount,
+            listedFileCount
+            ),
+        runtime_error
+        );
+    xcout.rdbuf(oldWriter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// BoundedQueue
+
+TEST_CASE("BoundedQueue", "[BoundedQueue]")
+{
+    BoundedQueue<int> queue(16);
+    thread producer(
+        [&queue]
+        {
+            for (int item = 0; item < 10000; ++item)
+            {
+                int pushedItem = item;
+                queue.push(move(pushedItem));
+            }
+            queue.close();
+        }
+        );
+    int expectedItem = 0;
+    for (int item; queue.pop(item); ++expectedItem)
+        REQUIRE(item == expectedItem);
+    producer.join();
+    REQUIRE(expectedItem == 10000);
+
+    // Canceling releases a producer blocked by a full queue.
+    BoundedQueue<int> fullQueue(1);
+    bool pushed = true;
+    thread blockedProducer(
+        [&fullQueue, &pushed]
+        {
+            fullQueue.push(1);
+            pushed = fullQueue.push(2);
+        }
+        );
+    this_thread::sleep_for(chrono::milliseconds(10));
+    fullQueue.cancel();
+    blockedProducer.join();
+    REQUIRE(!pushed);
+    int item;
+    REQUIRE(!fullQueue.pop(item));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// WorkStealingPool
+
+TEST_CASE("WorkStealingPool", "[WorkStealingPool]")
+{
+    vector<int> runCounts(1000);
+    vector<int> threadRunCounts(4);
+    {
+        WorkStealingPool pool(
+            4,
+            runCounts.size(),
+            [&runCounts, &threadRunCounts]
+            (unsigned int threadIndex, size_t taskIndex)
+            {
+                ++runCounts[taskIndex];
+                ++threadRunCounts[threadIndex];
+            }
+            );
+        pool.join();
+    }
+    for (int runCount: runCounts) REQUIRE(runCount == 1);
+    int totalRunCount = 0;
+    for (int runCount: threadRunCounts) totalRunCount += runCount;
+    REQUIRE(totalRunCount == 1000);
+
+    WorkStealingPool pool(
+        2,
+        100,
+        [] (unsigned int, size_t taskIndex)
+        {
+            if (taskIndex == 10) throw runtime_error("task failed");
+        }
+        );
+    REQUIRE_THROWS_AS(pool.join(), runtime_error);
+
+    REQUIRE_THROWS_AS(
+        WorkStealingPool(0, 1, [] (unsigned int, size_t) { }),
+        invalid_argument
+        );
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // MP3FrameException
 